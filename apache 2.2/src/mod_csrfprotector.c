@@ -36,6 +36,7 @@
 #include "http_protocol.h"
 #include "http_request.h"
 #include "util_filter.h"
+#include "ap_mpm.h"
 #include "ap_regex.h"
 
 /** APRs **/
@@ -44,6 +45,23 @@
 #include "apr_buckets.h"
 #include "apr_lib.h"
 #include "apr_strings.h"
+#include "apr_thread_mutex.h"
+#include "apr_thread_cond.h"
+#include "apr_thread_proc.h"
+#include "apr_shm.h"
+#include "apr_global_mutex.h"
+#include "apr_reslist.h"
+#include "apr_atomic.h"
+
+#ifdef AP_NEED_SET_MUTEX_PERMS
+#include "unixd.h"
+#endif
+
+/** httpd 2.4 **/
+#if AP_MODULE_MAGIC_AT_LEAST(20111130, 0)
+#define CSRFP_HTTPD_24
+#include "util_mutex.h"
+#endif
 
 /** SQLite library **/
 #include "sqlite/sqlite3.h"
@@ -65,9 +83,34 @@
 #define CSRFP_DISABLED_JS_MESSAGE_MAXLENGTH 512
 #define CSRFP_VERIFYGETFOR_MAXLENGTH 512
 #define CSRFP_GET_RULE_MAX_LENGTH 256
+#define CSRFP_UNSET -1
 
 #define DEFAULT_TOKEN_LENGTH 15
 #define DEFAULT_TOKEN_MINIMUM_LENGTH 12
+#define DEFAULT_SPOOL_SIZE 65536
+#define DEFAULT_NEG_CACHE_SIZE 1024
+#define DEFAULT_NEG_CACHE_TTL 60
+#define DEFAULT_TOKEN_CACHE_SIZE 1024
+#define CSRFP_TOKEN_CACHE_MAXAGE 60
+#define CSRFP_TOKEN_CACHE_MAXLENGTH 128
+#define CSRFP_ROTATE_NOTE "csrfp_rotate_token"
+#define CSRFP_DUPLICATE_NOTE "csrfp_duplicate_failure"
+#define CSRFP_VALIDATED_ENV "csrfp_validated"
+#define CSRFP_CHECKED_NOTE "csrfp_checked"
+#define CSRFP_STORE_WAITS_NOTE "csrfp_store_waits"
+#define CSRFP_BUSY_KEY "csrfp_busy_state"
+#define DEFAULT_ATTACK_LOG_RATE 10
+#define CSRFP_ATTACK_LOG_RING 256
+#define CSRFP_ATTACK_LOG_SLOTS 256
+#define CSRFP_ATTACK_LOG_FIELD_MAXLENGTH 256
+#define CSRFP_CLIENT_MAXLENGTH 64
+#define DEFAULT_THROTTLE_BURST 20
+#define CSRFP_THROTTLE_SLOTS 4096
+#define CSRFP_THROTTLE_UNIT 1000
+
+#ifndef HTTP_TOO_MANY_REQUESTS
+#define HTTP_TOO_MANY_REQUESTS 429
+#endif
 #define DEFAULT_ERROR_MESSAGE "<h2>ACCESS FORBIDDEN BY OWASP CSRF_PROTECTOR!</h2>"
 #define DEFAULT_REDIRECT_URL ""
 #define DEFAULT_JS_FILE_PATH "http://localhost/csrfp_js/csrfprotector.js"
@@ -79,14 +122,44 @@
 
 #define CSRFP_IGNORE_PATTERN ".*(jpg)|(jpeg)|(gif)|(png)|(js)|(css)|(xml)$"
 #define CSRFP_IGNORE_TEXT "csrfp_ignore_set"
+#define CSRFP_INJECT_HEADER "X-CSRFP-Inject"
 
 #define SQL_SESSID_DEFAULT_LENGTH 10
 #define TOKEN_EXPIRY_MAXTIME 1800
-
-#define DATABASE_DEFAULT_LOCATION "/tmp/csrfp.db"
+#define DEFAULT_TOKEN_WINDOW 1
+#define CSRFP_TOKEN_WINDOW_MAX 16
+#define CSRFP_RING_STAMP_LENGTH 10
+#define DEFAULT_STORE_BATCH_INTERVAL 20
+#define CSRFP_STORE_BATCH_QUEUE 4
+
+// Issue token ?2 at ?3 to session ?1, token being replaced is pushed to
+// the front of the ring, which is cut to ?4 chars so that oldest falls off
+#define CSRFP_SQL_ADDN "INSERT OR REPLACE INTO CSRFP (sessid, token, timestamp, ring)" \
+    " VALUES (?1, ?2, ?3, substr(coalesce((SELECT" \
+    " printf('%s%010d', token, timestamp) || coalesce(ring, '')" \
+    " FROM CSRFP WHERE sessid = ?1), ''), 1, ?4))"
+
+#define DEFAULT_STORE_DIRECTORY "/tmp"
+#define CSRFP_STORE_FILE "csrfp"
+#define CSRFP_STORE_SHARDS_MAX 64
+#define CSRFP_STORE_JOURNAL_MODES "DELETE TRUNCATE PERSIST MEMORY WAL OFF"
+#define CSRFP_STORE_SYNCHRONOUS "OFF NORMAL FULL"
+#define DEFAULT_STORE_BUSY_TIMEOUT 200
+#define CSRFP_STORE_RETRY_AFTER "1"     // seconds
+#define CSRFP_STORE_BACKOFF_MIN 500     // microseconds
+#define CSRFP_STORE_BACKOFF_MAX 50000   // microseconds
 
 #define RESEED_RAND_AT 10000
 
+#define CSRFP_THROTTLE_MUTEX "csrfp-throttle"
+
+// Address of the user agent, 2.4 tells it apart from the peer
+#ifdef CSRFP_HTTPD_24
+#define CSRFP_CLIENT_IP(r) ((r)->useragent_ip)
+#else
+#define CSRFP_CLIENT_IP(r) ((r)->connection->remote_ip)
+#endif
+
 //=============================================================
 // Definations of all data structures to be used later
 //=============================================================
@@ -97,7 +170,8 @@
 typedef enum
 {
     CSRFP_TRUE,
-    CSRFP_FALSE                         // Added CSRFP_ prefix to preven enum redeclaration error in OS X
+    CSRFP_FALSE,                        // Added CSRFP_ prefix to preven enum redeclaration error in OS X
+    CSRFP_FLAG_UNSET = CSRFP_UNSET      // Not set by any directive
 } Flag;                                 // Flag enum for stating weather to use...
                                         // ... mod or not
 
@@ -111,9 +185,79 @@ typedef enum
     strip,
     redirect,
     message,
-    internal_server_error
+    internal_server_error,
+    action_unset = CSRFP_UNSET          // Not set by any directive
 } csrfp_actions;                        // Action enum listing all actions
 
+/*
+ * Variable: csrfp_phases
+ * enumerator - lists the request phases in which validation can be done
+ */
+typedef enum
+{
+    phase_post_read_request,            // Right after request headers are read
+    phase_header_parser,                // Before authentication / authorization
+    phase_fixups,                       // Just before content handler, default
+    phase_unset = CSRFP_UNSET           // Not set by any directive
+} csrfp_phases;                         // Phase enum listing validation phases
+
+/*
+ * Variable: csrfp_origin_checks
+ * enumerator - lists the modes of Origin / Sec-Fetch-Site pre-check
+ */
+typedef enum
+{
+    origin_check_off,                   // No pre-check, token decides, default
+    origin_check_reject,                // Reject cross-site, token decides the rest
+    origin_check_trust,                 // Reject cross-site, accept same-origin...
+                                        // ...without token, token decides the rest
+    origin_check_unset = CSRFP_UNSET    // Not set by any directive
+} csrfp_origin_checks;                  // enum listing pre-check modes
+
+/*
+ * Variable: Request_Origin
+ * enumerator - lists where a request came from, as per its headers
+ */
+typedef enum
+{
+    origin_unknown,                     // No (conclusive) header
+    origin_same,                        // Same origin as this server
+    origin_cross                        // Clearly cross-site
+} Request_Origin;                       // enum of request origins
+
+/*
+ * Variable: csrfp_token_modes
+ * enumerator - lists how tokens are verified
+ */
+typedef enum
+{
+    token_mode_session,                 // Token stored against CSRFPSESSID in db, default
+    token_mode_double_submit,           // Token must equal token cookie, no db
+    token_mode_unset = CSRFP_UNSET      // Not set by any directive
+} csrfp_token_modes;                    // enum listing token verification modes
+
+/*
+ * Variable: csrfp_throttle_actions
+ * enumerator - lists what is done to a throttled client
+ */
+typedef enum
+{
+    throttle_429,                       // 429 Too Many Requests, default
+    throttle_drop,                      // Connection closed without response
+    throttle_action_unset = CSRFP_UNSET // Not set by any directive
+} csrfp_throttle_actions;               // enum listing throttle actions
+
+/*
+ * Variable: csrfp_throttle_keys
+ * enumerator - lists what identifies a client for throttling
+ */
+typedef enum
+{
+    throttle_key_ip,                    // Client address, default
+    throttle_key_session,               // CSRFPSESSID cookie, address if absent
+    throttle_key_unset = CSRFP_UNSET    // Not set by any directive
+} csrfp_throttle_keys;                  // enum listing throttle keys
+
 /*
  * Variable: Filter_Statae
  * enumerator - lists the state through which the output filter goes
@@ -126,6 +270,17 @@ typedef enum
     op_end                              // States output fiter task has finished
 } Filter_State;                         // enum of output filter states
 
+/*
+ * Variable: Inject_Policy
+ * enumerator - lists what backend asked for, via CSRFP_INJECT_HEADER
+ */
+typedef enum
+{
+    inject_default,                     // Inject if response is html
+    inject_on,                          // Inject regardless of Content-Type
+    inject_off                          // Don't touch response, nor token
+} Inject_Policy;                        // enum of backend injection policies
+
 /*
  * Variable: Filter_Cookie_Length_State
  * enumerator - lists the state of token cookie
@@ -138,7 +293,86 @@ typedef enum
 
 /*
  * Variable: csrfp_config
- * structure - structure of the csrfp configuration
+ * structure - structure of the csrfp configuration, one per server
+ * Settings allowed in <Location> / <Directory> are in csrfp_dir_config
+ *
+ * Fields are CSRFP_UNSET (an enum's *_unset, or NULL) after parsing,
+ * unless a directive set them; merged into virtual hosts by
+ * <csrfp_srv_config_merge>, defaults applied by <csrfp_srv_config_defaults> in post_config.
+ * Read only once requests are being served.
+ */
+typedef struct
+{
+    int tokenLength;                    // Length of CSRFP_TOKEN, Default 20
+    char *tokenName;                    // Name of the CSRFP token
+    ap_regex_t *ignore_pattern;         // Path pattern for which validation...
+                                        // ...is Not needed
+    apr_off_t spoolSize;                // Max bytes of html held back to send exact...
+                                        // ...Content-Length, 0 - always chunked
+    char *injectionMarker;              // Marker emitted by application where script...
+                                        // ...shall be injected, NULL - search <body
+    Flag regenForBodiless;              // Regenerate token for HEAD, 204, 206, 304...
+                                        // ...responses as well, false by default
+    csrfp_phases validationPhase;       // Request phase to validate in, Default - fixups
+    csrfp_origin_checks originCheck;    // Origin / Sec-Fetch-Site pre-check mode...
+                                        // ...Default - off
+    apr_array_header_t *trustedOrigins; // Origins (scheme://host[:port]) taken as...
+                                        // ...same origin besides this server's own
+    csrfp_token_modes tokenMode;        // Token verification mode, Default - session
+    int negCacheSize;                   // No of recently failed (sessid, token) pairs...
+                                        // ...remembered per child, 0 - disabled
+    int negCacheTTL;                    // Seconds a failed pair is remembered
+    int tokenCacheSize;                 // No of (sessid, token) pairs cached per...
+                                        // ...child in front of the store, 0 - disabled
+    int tokenRotateAge;                 // Seconds a token is reused for, 0 - no limit...
+                                        // ...(with tokenRotateUses == 0, every response)
+    int tokenRotateUses;                // Validations a token is reused for, 0 - no limit
+    int tokenWindow;                    // No of last issued tokens of a session...
+                                        // ...accepted, Default 1 - latest only
+    int storeBatchSize;                 // Issuances queued per child before they are...
+                                        // ...committed together, 0 - written inline
+    int storeBatchInterval;             // Max milliseconds an issuance stays queued
+    int storeShards;                    // No of db files token store is split into
+    const char *storeDirectory;         // Directory the db files are kept in
+    const char *storeJournalMode;       // journal_mode pragma of the store, NULL - as is
+    const char *storeSynchronous;       // synchronous pragma of the store, NULL - as is
+    int storeBusyTimeout;               // Milliseconds a request may wait on a locked store
+    apr_int64_t storeMmapSize;          // mmap_size pragma, in bytes
+    int storeCacheSize;                 // Page cache per connection, in KiB
+    int attackLogRate;                  // Attack log records per client per second...
+                                        // ...rest are aggregated, 0 - unlimited
+    int throttleRate;                   // Failed validations per minute allowed per...
+                                        // ...client in the long run, 0 - disabled
+    int throttleBurst;                  // Failed validations allowed in a burst
+    csrfp_throttle_actions throttleAction;  // Action for throttled client
+    csrfp_throttle_keys throttleKey;    // What identifies a client
+} csrfp_config;                         // CSRFP configuraion
+
+/*
+ * Variable: csrfp_policy
+ * structure - what to protect & how, resolved from a csrfp_dir_config
+ * with defaults filled in and payloads prebuilt, read only
+ */
+typedef struct
+{
+    Flag flag;                          // Validation enabled
+    csrfp_actions action;               // Action on failed validation
+    const char *errorRedirectionUri;    // Uri to redirect in case action == redirect
+    const char *errorCustomMessage;     // Message to show in case action == message
+    const char *jsFilePath;             // Absolute path for JS file
+    struct getRuleNode *getRules;       // verifyGetFor rules in effect
+    const char *getRuleString;          // getRules quoted for CSRFP.checkForUrls
+    const char *noscript;               // <noscript>..</noscript> to be injected
+} csrfp_policy;
+
+/*
+ * Variable: csrfp_dir_config
+ * structure - per directory / location configuration
+ *
+ * Fields are CSRFP_UNSET (an enum's *_unset, or NULL) unless a directive
+ * in this section set them. Server defaults are resolved in post_config,
+ * a section's policy is resolved once per base policy it is merged onto
+ * & cached in merges, so requests only fetch a pointer.
  */
 typedef struct
 {
@@ -148,12 +382,25 @@ typedef struct
     char *errorRedirectionUri;          // Uri to redirect in case action == redirect
     char *errorCustomMessage;           // Message to show in case action == message
     char *jsFilePath;                   // Absolute path for JS file
-    int tokenLength;                    // Length of CSRFP_TOKEN, Default 20
-    char *tokenName;                    // Name of the CSRFP token
     char *disablesJsMessage;            // Message to be shown in <noscript>
-    ap_regex_t *ignore_pattern;         // Path pattern for which validation...
-                                        // ...is Not needed
-} csrfp_config;                         // CSRFP configuraion
+    struct getRuleNode *getRules;       // verifyGetFor rules of this section...
+                                        // ...NULL - rules of enclosing section apply
+    struct getRuleNode *getRulesTail;   // Last node of getRules, for appending
+    csrfp_policy *policy;               // Resolved policy, NULL until resolved
+    struct csrfp_policy_link *merges;   // Policies of this section merged onto...
+                                        // ...base policies, see <csrfp_dir_config_merge>
+} csrfp_dir_config;                     // CSRFP per directory configuration
+
+/*
+ * Variable: csrfp_policy_link
+ * structure - policy of a section merged onto a base policy
+ */
+typedef struct csrfp_policy_link
+{
+    const csrfp_policy *base;           // Policy of enclosing section
+    csrfp_policy *merged;               // Result of merging this section onto it
+    struct csrfp_policy_link *next;
+} csrfp_policy_link;
 
 /*
  * Variable: csrfp_opf_ctx
@@ -170,10 +417,16 @@ typedef struct
                                         // ...modified, true for modified or need not modify
     char *overlap_buf;                  // Buffer to store content of current bb->b buffer ...
                                         // ... for next iteration in op filter [el]
+    Flag tokenIssued;                   // CSRFP_TRUE once csrfp_token cookie has been...
+                                        // ...regenerated for this response
+    Flag spooling;                      // CSRFP_TRUE while response is held back to...
+                                        // ...calculate exact Content-Length
+    apr_bucket_brigade *spool;          // Response held back so far
+    apr_size_t markerMatched;           // Bytes of injectionMarker matched at the...
+                                        // ...end of previous bucket
+    apr_size_t *markerFail;             // KMP failure table of injectionMarker
 } csrfp_opf_ctx;                        // CSRFP output filter context
 
-static csrfp_config *config;
-
 /*
  * Variable: getRuleNode
  * structure - linked list node for storing the GET rules
@@ -185,24 +438,283 @@ typedef struct getRuleNode
     struct getRuleNode *next;
 };
 
-struct getRuleNode *getTop = NULL, *getPointer = NULL;
+/*
+ * Variable: csrfp_neg_entry
+ * structure - slot of the negative cache, recently failed (sessid, token) pair
+ */
+typedef struct
+{
+    apr_uint64_t key;                   // Hash of sessid & token, 0 - empty slot
+    apr_time_t expiry;                  // Time after which slot is stale
+    int suppressed;                     // Repeats rejected without logging
+    server_rec *server;                 // Server the pair failed on
+    char client[CSRFP_CLIENT_MAXLENGTH]; // Client the pair came from
+} csrfp_neg_entry;
+
+/*
+ * Variable: csrfp_pending_issue
+ * structure - token issuance queued for the batch writer
+ */
+typedef struct
+{
+    char sessid[SQL_SESSID_DEFAULT_LENGTH + 1];     // Session id
+    char token[CSRFP_TOKEN_CACHE_MAXLENGTH];        // Token issued
+    int timestamp;                      // Time of issue, unix time
+    int ringLength;                     // Chars of ring kept, see CSRFP_SQL_ADDN
+    int window;                         // tokenWindow of the server
+    struct csrfp_store_shard *shard;    // Store shard of sessid
+    int done;                           // Committed, waiting to be dequeued
+} csrfp_pending_issue;
+
+/*
+ * Variable: csrfp_busy_state
+ * structure - waiting on a locked store, of a request (or the batch writer)
+ */
+typedef struct
+{
+    apr_time_t deadline;                // No more waiting after it
+    apr_uint32_t seed;                  // Jitter of backoff, xorshift state
+    int waits;                          // Backoff sleeps so far
+    int timedOut;                       // Gave up on a locked store
+} csrfp_busy_state;
+
+/*
+ * Variable: csrfp_store_shard
+ * structure - partition of the token store, a db file with its own lock
+ */
+typedef struct csrfp_store_shard
+{
+    const char *path;                   // Path of the db file
+    server_rec *server;                 // Server whose config the store follows
+#if APR_HAS_THREADS
+    apr_reslist_t *pool;                // Per child pool of connections to it
+    sqlite3 *writer;                    // Batch writer's connection, opened by it
+    unsigned int round;                 // Last batch writer round it was committed in
+#endif
+} csrfp_store_shard;
+
+/*
+ * Variable: csrfp_store
+ * structure - token store of one or more servers, servers with same
+ * storeDirectory & storeShards share it
+ */
+typedef struct csrfp_store
+{
+    const char *directory;              // storeDirectory
+    int shardCount;                     // storeShards
+    csrfp_store_shard *shards;
+    struct csrfp_store *next;           // Next in storeList
+} csrfp_store;
+
+/*
+ * Variable: csrfp_token_entry
+ * structure - entry of the per child token cache, hashed by sessid &
+ * linked in least recently used order
+ */
+typedef struct
+{
+    char sessid[SQL_SESSID_DEFAULT_LENGTH + 1];     // Key, "" - free entry
+    char token[CSRFP_TOKEN_CACHE_MAXLENGTH];        // Token of sessid in store
+    apr_time_t expiry;                  // Time after which entry is stale
+    apr_time_t issued;                  // Time token was issued
+    int uses;                           // Validations passed in this child
+    int hnext;                          // Next entry in hash chain, -1 - none
+    int prev;                           // More recently used entry, -1 - none
+    int next;                           // Less recently used entry, -1 - none
+} csrfp_token_entry;
+
+/*
+ * Variable: Attack_Log_Kind
+ * enumerator - lists the kinds of attack log records
+ */
+typedef enum
+{
+    log_attack,                         // A failed validation
+    log_repeated,                       // Replays rejected by negative cache
+    log_rate_limited                    // Records suppressed by attackLogRate
+} Attack_Log_Kind;                      // enum of attack log record kinds
+
+/*
+ * Variable: csrfp_attack_record
+ * structure - attack log record, copied out of the request so that
+ * it can be written after the request is gone
+ */
+typedef struct
+{
+    Attack_Log_Kind kind;
+    server_rec *server;                 // Server to log against
+    int action;                         // csrfp_actions taken
+    int count;                          // No of suppressed records, for aggregates
+    char client[CSRFP_CLIENT_MAXLENGTH];
+    char method[16];
+    char url[CSRFP_ATTACK_LOG_FIELD_MAXLENGTH];
+    char args[CSRFP_ATTACK_LOG_FIELD_MAXLENGTH];
+} csrfp_attack_record;
+
+/*
+ * Variable: csrfp_rate_slot
+ * structure - per client attack log budget for the current second
+ */
+typedef struct
+{
+    apr_uint64_t key;                   // Hash of client address, 0 - empty slot
+    apr_time_t window;                  // Second this budget belongs to
+    int count;                          // Records in this second
+    int suppressed;                     // Records over budget, not yet reported
+    server_rec *server;
+    char client[CSRFP_CLIENT_MAXLENGTH];
+} csrfp_rate_slot;
+
+// Per child attack log ring & rate limit table, allocated in child_init
+// ring is drained by a writer thread, or written inline without threads
+static csrfp_attack_record *attackLog = NULL;
+static apr_uint32_t attackLogHead = 0, attackLogTail = 0;
+static int attackLogDropped = 0;
+static csrfp_rate_slot *attackRate = NULL;
+#if APR_HAS_THREADS
+static apr_thread_mutex_t *attackLogMutex = NULL;
+static apr_thread_cond_t *attackLogCond = NULL;
+static apr_thread_t *attackLogThread = NULL;
+static int attackLogStop = 0;
+#endif
+
+/*
+ * Variable: csrfp_throttle_slot
+ * structure - token bucket of a client, in shared memory
+ */
+typedef struct
+{
+    apr_uint64_t key;                   // Hash of client, 0 - empty slot
+    apr_time_t last;                    // Last refill of the bucket
+    long tokens;                        // Failures left, in CSRFP_THROTTLE_UNIT
+} csrfp_throttle_slot;
+
+// Token buckets shared by all children, created in post_config
+static apr_shm_t *throttleShm = NULL;
+static csrfp_throttle_slot *throttleTable = NULL;
+static apr_global_mutex_t *throttleMutex = NULL;
+
+/*
+ * Thread safety:
+ * Under worker / event MPMs hooks run concurrently in several threads
+ * of a child. Configuration is read only after post_config; request
+ * state lives in r->pool / r->request_config. Remaining per child
+ * state below is guarded by its own mutex, store connections are
+ * handed out exclusively by the pool of their <csrfp_store_shard>.
+ */
+
+// Per child pool & lock for section policies resolved while serving
+// requests, see <csrfp_dir_config_merge>. NULL while reading config
+static apr_pool_t *policyPool = NULL;
+static int policyUncached = 0;          // Couldn't set up, resolve per request
+#if APR_HAS_THREADS
+static apr_thread_mutex_t *policyMutex = NULL;
+#endif
+
+// Per child negative cache, direct mapped, allocated in child_init
+static csrfp_neg_entry *negCache = NULL;
+static int negCacheSize = 0;
+#if APR_HAS_THREADS
+static apr_thread_mutex_t *negCacheMutex = NULL;
+#endif
+
+// Per child token cache (L1 in front of the store), allocated in child_init
+static csrfp_token_entry *tokenCache = NULL;
+static int *tokenCacheBuckets = NULL;
+static int tokenCacheSize = 0;
+static int tokenCacheHead = -1;         // Most recently used entry
+static int tokenCacheTail = -1;         // Least recently used entry
+#if APR_HAS_THREADS
+static apr_thread_mutex_t *tokenCacheMutex = NULL;
+#endif
+
+// Per child queue of token issuances, committed by batch writer thread
+// entries in [batchHead, batchTail) are queued or being committed
+#if APR_HAS_THREADS
+static csrfp_pending_issue *batchQueue = NULL;
+static unsigned int batchCapacity = 0;
+static unsigned int batchHead = 0, batchTail = 0;
+static unsigned int batchSize = 0;
+static apr_interval_time_t batchInterval = 0;
+static int batchIssued = 0;
+static int batchStop = 0;
+static unsigned int batchRound = 0;
+static apr_pool_t *batchPool = NULL;
+static csrfp_busy_state batchBusy;
+static apr_thread_mutex_t *batchMutex = NULL;
+static apr_thread_cond_t *batchCond = NULL;
+static apr_thread_t *batchThread = NULL;
+#endif
+
+// Token stores of servers, sessions are spread over shards of their
+// server's store by hash of sessid. Set up in child_init, read only later
+static apr_hash_t *storeByServer = NULL;
+static csrfp_store *storeList = NULL;
+static csrfp_store *mainStore = NULL;
+
+// Per child store contention counters, see <csrfp_sql_busy>
+static volatile apr_uint32_t storeBusyEvents = 0;   // Statements that found store locked
+static volatile apr_uint32_t storeBusyWaits = 0;    // Backoff sleeps
+static volatile apr_uint32_t storeBusyTimeouts = 0; // Deadlines run out
 //=============================================================
 // Globals
 //=============================================================
 module AP_MODULE_DECLARE_DATA csrf_protector_module;
+#ifdef APLOG_USE_MODULE
+APLOG_USE_MODULE(csrf_protector);
+#endif
 
 // Declarations for functions
 static char *generateToken(request_rec *r, int length);
 static const char *csrfp_strncasestr(const char *s1, const char *s2, int len);
+static const char *csrfp_memmem(const char *s1, apr_size_t len1, const char *s2, apr_size_t len2);
+static apr_size_t csrfp_marker_step(const char *marker, const apr_size_t *fail,
+                                    apr_size_t matched, char c);
+static int csrfp_token_equals(const char *s1, const char *s2);
 static apr_table_t *csrfp_get_query(request_rec *r);
 static char* getCookieToken(request_rec *r, char *key);
+static int isWellFormedToken(const char *value, apr_size_t length);
 static csrfp_opf_ctx *csrfp_get_rctx(request_rec *r);
 
+//Declarations for negative cache functions
+static apr_uint64_t csrfp_pair_hash(const char *sessid, const char *token);
+static int csrfp_negcache_hit(request_rec *r, apr_uint64_t key);
+static void csrfp_negcache_add(request_rec *r, apr_uint64_t key);
+
+//Declarations for token cache functions
+static int csrfp_tokencache_match(const char *sessid, const char *value);
+static int csrfp_tokencache_issued(const char *sessid, const char *token, apr_time_t *issued);
+static int csrfp_tokencache_use(const char *sessid);
+static void csrfp_tokencache_put(const char *sessid, const char *token, apr_time_t issued);
+
+//Declarations for write behind functions
+static int csrfp_batch_push(request_rec *r, const char *sessid, const char *value);
+static int csrfp_batch_count(void);
+static int csrfp_batch_match(const char *sessid, const char *value, int *issued);
+
+//Declarations for attack log functions
+static void csrfp_attacklog_push(request_rec *r, Attack_Log_Kind kind, int count);
+static void csrfp_attacklog_write(const csrfp_attack_record *rec);
+
+//Declarations for throttle functions
+static int csrfp_throttle(request_rec *r, int charge);
+
+//Declarations for configuration functions
+static void csrfp_srv_config_defaults(apr_pool_t *p, csrfp_config *conf);
+static csrfp_policy *csrfp_policy_resolve(apr_pool_t *p, const csrfp_dir_config *dconf);
+static csrfp_policy *csrfp_policy_overlay(apr_pool_t *p, const csrfp_policy *base,
+                                          const csrfp_dir_config *add);
+static const csrfp_policy *csrfp_get_policy(request_rec *r);
+
 //Declarations for SQLite based functions
 static void csrfp_sql_table_clean(request_rec *r, sqlite3 *db);
-static sqlite3 *csrfp_sql_init(request_rec *r);
-static int csrfp_sql_match(request_rec *r, sqlite3 *db, const char *sessid, const char *value);
+static csrfp_store_shard *csrfp_store_shard_of(request_rec *r, const char *sessid);
+static sqlite3 *csrfp_sql_init(request_rec *r, const char *sessid);
+static void csrfp_sql_release(request_rec *r, const char *sessid, sqlite3 *db);
+static int csrfp_sql_match(request_rec *r, sqlite3 *db, const char *sessid, const char *value,
+                            int *issued);
 static int csrfp_sql_addn(request_rec *r, sqlite3 *db, const char *sessid, const char *value);
+static int csrfp_ring_match(request_rec *r, const char *ring, const char *value, int oldest);
 static int csrfp_sql_update_counter(request_rec *r, sqlite3 *db);
 
 //=============================================================
@@ -259,6 +771,90 @@ static const char *csrfp_strncasestr(const char *s1, const char *s2, int len) {
   return((char *)s1);
 }
 
+/*
+ * Function: csrfp_memmem
+ * Exact byte search of s2 within s1, like memmem() which is not
+ * available on every platform
+ *
+ * Parameters:
+ * s1 - Buffer to search in
+ * len1 - Length of s1
+ * s2 - Pattern to find
+ * len2 - Length of s2
+ *
+ * Returns:
+ * char* - pointer to first occurance of s2 within s1, or NULL
+ */
+static const char *csrfp_memmem(const char *s1, apr_size_t len1, const char *s2, apr_size_t len2)
+{
+    const char *p = s1, *e1 = s1 + len1;
+    if (len2 == 0) {
+        return s1;
+    }
+    while (len2 <= (apr_size_t)(e1 - p)) {
+        p = memchr(p, *s2, (e1 - p) - len2 + 1);
+        if (p == NULL) {
+            return NULL;
+        }
+        if (!memcmp(p, s2, len2)) {
+            return p;
+        }
+        ++p;
+    }
+    return NULL;
+}
+
+/*
+ * Function: csrfp_marker_step
+ * Advances a KMP match of marker by one byte, falling back through the
+ * failure table so that self-overlapping markers (e.g. "aab" seen as
+ * "aa" + "ab") are not missed
+ *
+ * Parameters:
+ * marker - Pattern being matched
+ * fail - failure table, fail[i] is the longest proper border of marker[0..i]
+ * matched - Bytes of marker matched so far, less than strlen(marker)
+ * c - next byte of input
+ *
+ * Returns:
+ * apr_size_t - Bytes of marker matched after c
+ */
+static apr_size_t csrfp_marker_step(const char *marker, const apr_size_t *fail,
+                                    apr_size_t matched, char c)
+{
+    while (matched > 0 && marker[matched] != c) {
+        matched = fail[matched - 1];
+    }
+    if (marker[matched] == c) {
+        ++matched;
+    }
+    return matched;
+}
+
+/*
+ * Function: csrfp_token_equals
+ * Compares two tokens in time independent of the position of first
+ * mismatch, so that token can't be guessed byte by byte
+ *
+ * Parameters:
+ * s1 - token
+ * s2 - token to compare with
+ *
+ * Returns:
+ * int - 1 if tokens are equal, 0 otherwise
+ */
+static int csrfp_token_equals(const char *s1, const char *s2)
+{
+    apr_size_t len1 = strlen(s1), len2 = strlen(s2), i;
+    unsigned char diff = (len1 != len2);
+
+    // Length is not a secret, but keep the loop bound by s1 anyway
+    for (i = 0; i < len1; i++) {
+        diff |= (unsigned char)s1[i] ^ (unsigned char)(i < len2 ? s2[i] : 0);
+    }
+    return diff == 0;
+}
+
 /*
  * Function: getCurrentUrl
  * Function to retrun current url
@@ -292,7 +888,7 @@ static char* generateToken(request_rec *r, int length)
 {
     const char *charset = apr_psprintf(r->pool, "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ1234567890");
     char *token = NULL;
-    token = apr_pcalloc(r->pool, sizeof(char) * length);
+    token = apr_pcalloc(r->pool, sizeof(char) * (length + 1));
     unsigned char buf[length];
     RAND_pseudo_bytes(buf, sizeof(buf));
     int i, len = strlen(charset);
@@ -334,9 +930,67 @@ static apr_table_t *csrfp_get_query(request_rec *r)
     return tbl;
 }
 
+/*
+ * Function: isTokenDue
+ * Function to decide whether client's token has to be rotated, or
+ * can be reused (no Set-Cookie, no store write) as per tokenRotateAge
+ * and tokenRotateUses. Token is never reused past half its lifetime
+ *
+ * Parameters:
+ * r - request_rec object
+ *
+ * Returns:
+ * int, 1 if a new token has to be issued, 0 otherwise
+ */
+static int isTokenDue(request_rec *r)
+{
+    csrfp_config *conf = ap_get_module_config(r->server->module_config,
+                                                &csrf_protector_module);
+    apr_time_t issued;
+    int maxAge = TOKEN_EXPIRY_MAXTIME / 2;
+
+    if ((conf->tokenRotateAge == 0 && conf->tokenRotateUses == 0)
+        || conf->tokenMode == token_mode_double_submit
+        || apr_table_get(r->notes, CSRFP_ROTATE_NOTE)) {
+        return 1;
+    }
+
+    char *token = getCookieToken(r, conf->tokenName);
+    char *sessid = getCookieToken(r, CSRFP_SESS_TOKEN);
+    if (!isWellFormedToken(token, conf->tokenLength)
+        || !isWellFormedToken(sessid, SQL_SESSID_DEFAULT_LENGTH)) {
+        return 1;
+    }
+
+    int seconds;
+    if (csrfp_batch_match(sessid, token, &seconds)) {
+        issued = apr_time_from_sec(seconds);
+    } else if (!csrfp_tokencache_issued(sessid, token, &issued)) {
+        // Read only, store is written only if token is rotated
+        sqlite3 *db = csrfp_sql_init(r, sessid);
+        if (db == NULL) {
+            return 1;
+        }
+        int rc = csrfp_sql_match(r, db, sessid, token, &seconds);
+        csrfp_sql_release(r, sessid, db);
+        if (rc) {
+            // Not the current token of the session (or expired)
+            return 1;
+        }
+        issued = apr_time_from_sec(seconds);
+    }
+
+    if (conf->tokenRotateAge > 0 && conf->tokenRotateAge < maxAge) {
+        maxAge = conf->tokenRotateAge;
+    }
+    return apr_time_now() - issued >= apr_time_from_sec(maxAge);
+}
+
 /*
  * Function: setTokenCookie
- * Function to append new CSRFP_TOKEN to output header
+ * Function to append new CSRFP_TOKEN to output header, and store it
+ * against the session. Store write is queued for the batch writer if
+ * it is running, done inline otherwise
  *
  * Parameters:
  * r - request_rec object
@@ -344,7 +998,7 @@ static apr_table_t *csrfp_get_query(request_rec *r)
  * Returns:
  * void
  */
-static void setTokenCookie(request_rec *r, sqlite3 *db)
+static void setTokenCookie(request_rec *r)
 {
     csrfp_config *conf = ap_get_module_config(r->server->module_config,
                                                 &csrf_protector_module);
@@ -353,24 +1007,50 @@ static void setTokenCookie(request_rec *r, sqlite3 *db)
     // Generate a new token
     token = generateToken(r, conf->tokenLength);
 
-    // Send token as cookie header #todo - set expiry time of this token
+    // Token cookie header #todo - set expiry time of this token
     cookie = apr_psprintf(r->pool, "%s=%s; Version=1; Path=/;", conf->tokenName, token);
-    apr_table_addn(r->headers_out, "Set-Cookie", cookie);
+
+    if (conf->tokenMode == token_mode_double_submit) {
+        // Cookie itself is the reference value, nothing to store
+        apr_table_addn(r->headers_out, "Set-Cookie", cookie);
+        return;
+    }
 
     //SESSION PART
     sessid = getCookieToken(r, CSRFP_SESS_TOKEN);
-    if (sessid == NULL) {
+    if (!isWellFormedToken(sessid, SQL_SESSID_DEFAULT_LENGTH)) {
         sessid = generateToken(r, SQL_SESSID_DEFAULT_LENGTH);       
     }
 
-    // Add / Update it to database
-    csrfp_sql_addn(r, db, sessid, token);
+    // Add / Update it to database, old token is no longer cached
+    sqlite3 *db = NULL;
+    int queued = csrfp_batch_push(r, sessid, token);
+    if (!queued) {
+        // Start the sql connection
+        db = csrfp_sql_init(r, sessid);
+        if (db == NULL) {
+            ap_log_rerror(APLOG_MARK, APLOG_NOERRNO|APLOG_ERR, 0, r,
+                      "CSRFP UNABLE TO ACCESS DB OBJECT");
+        }
+    }
+    if (!queued && (db == NULL || csrfp_sql_addn(r, db, sessid, token) != SQLITE_OK)) {
+        // Not stored (e.g. store still locked), client keeps its
+        // current token, which stays valid
+        if (db) {
+            csrfp_sql_release(r, sessid, db);
+        }
+        return;
+    }
+    csrfp_tokencache_put(sessid, token, apr_time_now());
 
+    // Send token & session cookies, only once token is stored
+    apr_table_addn(r->headers_out, "Set-Cookie", cookie);
     cookie = apr_psprintf(r->pool, "%s=%s; Version=1; Path=/; HttpOnly;", CSRFP_SESS_TOKEN, sessid);
     apr_table_addn(r->headers_out, "Set-Cookie", cookie);
 
-    // Update counter & reseed if needed
-    int counter = csrfp_sql_update_counter(r, db);
+    // Update counter & reseed if needed, queued issuances are
+    // counted per child, as store isn't touched
+    int counter = queued ? csrfp_batch_count() : csrfp_sql_update_counter(r, db);
     if (counter == RESEED_RAND_AT) {
         //Reseed the RAND value, get rand values from /dev/urandom & reseed
         char buf[conf->tokenLength];
@@ -385,16 +1065,26 @@ static void setTokenCookie(request_rec *r, sqlite3 *db)
         RAND_seed(buf, sizeof(buf));
 
         // Now reset the counter
-        const char *sql = apr_psprintf(r->pool, "UPDATE CSRFP_COUNTER SET counter = 0");
-        char *zErrMsg = NULL;
-        int rc = sqlite3_exec(db, sql, 0, 0, &zErrMsg);
-        if (rc != SQLITE_OK) {
-            #ifdef DEBUG
-                apr_table_addn(r->headers_out, "sql-counter-reset-error", zErrMsg);
-            #endif
+        if (db) {
+            const char *sql = apr_psprintf(r->pool, "UPDATE CSRFP_COUNTER SET counter = 0");
+            char *zErrMsg = NULL;
+            int rc = sqlite3_exec(db, sql, 0, 0, &zErrMsg);
+            if (rc != SQLITE_OK) {
+                #ifdef DEBUG
+                    apr_table_addn(r->headers_out, "sql-counter-reset-error", zErrMsg);
+                #endif
+            }
         }
 
     }
+
+    if (db) {
+        // Clean old expired values, of this shard
+        csrfp_sql_table_clean(r, db);
+
+        // Hand the sql connection back
+        csrfp_sql_release(r, sessid, db);
+    }
 } 
 
 /*
@@ -429,65 +1119,310 @@ static char* getCookieToken(request_rec *r, char *key)
 
 
 /*
- * Function: validateToken
- * Function to validate GET token, csrfp_token in GET query parameter
+ * Function: csrfp_origin_equals
+ * Tells if url is origin, or (prefix) a url under it
+ *
+ * Parameters: 
+ * url - Origin or Referer header
+ * origin - scheme://host[:port]
+ * prefix - 1 if url may go on with a path
+ *
+ * Return: 
+ * int, 1 if it is
+ */
+static int csrfp_origin_equals(const char *url, const char *origin, int prefix)
+{
+    apr_size_t len = strlen(origin);
+
+    if (!prefix) {
+        return !strcasecmp(url, origin);
+    }
+    return !strncasecmp(url, origin, len)
+        && (url[len] == '\0' || url[len] == '/'
+            || url[len] == '?' || url[len] == '#');
+}
+
+/*
+ * Function: csrfp_origin_is_self
+ * Tells if url belongs to this server, as it sees itself or as one of
+ * trustedOrigins (e.g. scheme & port seen by clients of a TLS
+ * terminating proxy)
  *
  * Parameters: 
  * r - request_rec pointer
+ * url - Origin or Referer header
+ * prefix - 1 if url may go on with a path
  *
  * Return: 
- * int, 0 - for failed validation, 1 - for passed
+ * int, 1 if it does
  */
-static int validateToken(request_rec *r, sqlite3 *db)
+static int csrfp_origin_is_self(request_rec *r, const char *url, int prefix)
 {
     csrfp_config *conf = ap_get_module_config(r->server->module_config,
                                                 &csrf_protector_module);
+    int i;
 
-    //get table of all GET key-value pairs
-    apr_table_t *GET = NULL;
-    GET = csrfp_get_query(r);
-
-    if (!GET) return 0;
-
-    //retrieve our CSRF_token from the table
-    const char *tokenValue = NULL;
-    tokenValue = apr_table_get(GET, conf->tokenName);
-
-    if (!tokenValue) return 0;
-    else {
-        char *sessid = getCookieToken(r, CSRFP_SESS_TOKEN);
-        if (sessid == NULL) {
-            return 0;
+    // scheme://host[:port] of this server
+    if (csrfp_origin_equals(url, ap_construct_url(r->pool, "", r), prefix)) {
+        return 1;
+    }
+    for (i = 0; conf->trustedOrigins && i < conf->trustedOrigins->nelts; i++) {
+        if (csrfp_origin_equals(url, APR_ARRAY_IDX(conf->trustedOrigins, i,
+                                                   const char *), prefix)) {
+            return 1;
         }
-        if ( !csrfp_sql_match(r, db, sessid, tokenValue)) return 1;
-        //token doesn't match
-        return 0;
     }
+    return 0;
 }
 
 /*
- * Function: getOutputContentType
- * Returns content type of output generated by content generator
+ * Function: getRequestOrigin
+ * Function to classify request as same-origin / cross-site from
+ * Sec-Fetch-Site, Origin or Referer header (in that order), without
+ * touching the token store
  *
- * Parametes:
- * r - request_rec object
+ * Parameters: 
+ * r - request_rec pointer
  *
- * Returns: 
- * content type - string
+ * Return: 
+ * Request_Origin
  */
-static const char *getOutputContentType(request_rec *r) {
-    const char* type = NULL;
-    type = apr_table_get(r->headers_out, "Content-Type");
-    if (type == NULL) {
-        // maybe an error page
-        type = apr_table_get(r->err_headers_out, "Content-Type");
+static Request_Origin getRequestOrigin(request_rec *r)
+{
+    const char *site = apr_table_get(r->headers_in, "Sec-Fetch-Site");
+    if (site) {
+        if (!strcasecmp(site, "same-origin")) return origin_same;
+        if (!strcasecmp(site, "cross-site")) return origin_cross;
+        // same-site, none - not conclusive
+        return origin_unknown;
     }
-    if (type == NULL) {
-        type = r->content_type;
+
+    const char *origin = apr_table_get(r->headers_in, "Origin");
+    if (origin) {
+        // 'null' is sent by sandboxed frames & privacy redirects
+        if (!strcasecmp(origin, "null")) return origin_unknown;
+        return csrfp_origin_is_self(r, origin, 0) ? origin_same : origin_cross;
     }
-    return type;
+
+    const char *referer = apr_table_get(r->headers_in, "Referer");
+    if (referer && *referer) {
+        return csrfp_origin_is_self(r, referer, 1) ? origin_same : origin_cross;
+    }
+    return origin_unknown;
 }
 
+/*
+ * Function: isWellFormedToken
+ * Function to check a token / session id has exactly the length and
+ * alphabet generateToken() produces, so that garbage never reaches the store.
+ * Loop is branch free, so that compiler can vectorize it for long values
+ *
+ * Parameters: 
+ * value - token or session id sent by client
+ * length - expected length
+ *
+ * Return: 
+ * int, 1 if well formed, 0 otherwise
+ */
+static int isWellFormedToken(const char *value, apr_size_t length)
+{
+    apr_size_t i;
+    unsigned char bad = 0;
+
+    if (value == NULL) {
+        return 0;
+    }
+
+    // Length first, never reading past the terminator
+    for (i = 0; i <= length && value[i] != '\0'; i++);
+    if (i != length) {
+        return 0;
+    }
+
+    for (i = 0; i < length; i++) {
+        unsigned char c = (unsigned char)value[i];
+        bad |= !(((unsigned)(c - 'a') < 26u)
+                | ((unsigned)(c - 'A') < 26u)
+                | ((unsigned)(c - '0') < 10u));
+    }
+    return bad == 0;
+}
+
+/*
+ * Function: validateToken
+ * Function to validate GET token, csrfp_token in GET query parameter
+ * Malformed tokens & session ids are rejected before token store is opened
+ *
+ * Parameters: 
+ * r - request_rec pointer
+ *
+ * Return: 
+ * int, 0 - for failed validation, 1 - for passed, -1 - store unavailable
+ */
+static int validateToken(request_rec *r)
+{
+    csrfp_config *conf = ap_get_module_config(r->server->module_config,
+                                                &csrf_protector_module);
+
+    //get table of all GET key-value pairs
+    apr_table_t *GET = NULL;
+    GET = csrfp_get_query(r);
+
+    if (!GET) return 0;
+
+    //retrieve our CSRF_token from the table
+    const char *tokenValue = NULL;
+    tokenValue = apr_table_get(GET, conf->tokenName);
+
+    if (!isWellFormedToken(tokenValue, conf->tokenLength)) return 0;
+    else if (conf->tokenMode == token_mode_double_submit) {
+        // Attacker can't read (nor set) our cookie, so a copy of
+        // it in the request proves it was made by our page
+        char *cookieValue = getCookieToken(r, conf->tokenName);
+        if (!isWellFormedToken(cookieValue, conf->tokenLength)) {
+            return 0;
+        }
+        return csrfp_token_equals(cookieValue, tokenValue);
+    } else {
+        char *sessid = getCookieToken(r, CSRFP_SESS_TOKEN);
+        if (!isWellFormedToken(sessid, SQL_SESSID_DEFAULT_LENGTH)) {
+            return 0;
+        }
+
+        // Same forged pair replayed, reject without store lookup
+        apr_uint64_t key = csrfp_pair_hash(sessid, tokenValue);
+        if (csrfp_negcache_hit(r, key)) {
+            apr_table_setn(r->notes, CSRFP_DUPLICATE_NOTE, "1");
+            return 0;
+        }
+
+        // Token seen by this child recently or not yet committed,
+        // no store access
+        int rc = !csrfp_tokencache_match(sessid, tokenValue)
+                && !csrfp_batch_match(sessid, tokenValue, NULL);
+        if (rc) {
+            // Start the sql connection
+            sqlite3 *db = csrfp_sql_init(r, sessid);
+            if (db == NULL) {
+                return -1;
+            }
+
+            rc = csrfp_sql_match(r, db, sessid, tokenValue, NULL);
+
+            // Hand the sql connection back
+            csrfp_sql_release(r, sessid, db);
+
+            // Store unreadable isn't a forged token
+            if (rc < 0) {
+                return -1;
+            }
+        }
+
+        if ( !rc ) {
+            // Used up, response to this request carries a new token
+            if (conf->tokenRotateUses > 0
+                && csrfp_tokencache_use(sessid) >= conf->tokenRotateUses) {
+                apr_table_setn(r->notes, CSRFP_ROTATE_NOTE, "1");
+            }
+            return 1;
+        }
+        //token doesn't match
+        if (conf->storeBatchSize == 0) {
+            // With batching it may be issued by another child & still
+            // queued in its writer, don't let that miss stick
+            csrfp_negcache_add(r, key);
+        }
+        return 0;
+    }
+}
+
+/*
+ * Function: getOutputContentType
+ * Returns content type of output generated by content generator
+ *
+ * Parametes:
+ * r - request_rec object
+ *
+ * Returns: 
+ * content type - string
+ */
+static const char *getOutputContentType(request_rec *r) {
+    const char* type = NULL;
+    type = apr_table_get(r->headers_out, "Content-Type");
+    if (type == NULL) {
+        // maybe an error page
+        type = apr_table_get(r->err_headers_out, "Content-Type");
+    }
+    if (type == NULL) {
+        type = r->content_type;
+    }
+    return type;
+}
+
+
+/*
+ * Function: getInjectPolicy
+ * Reads (and strips) CSRFP_INJECT_HEADER set by backend, a response
+ * with Cache-Control: no-transform is treated as opted out as well
+ *
+ * Parametes:
+ * r - request_rec object
+ *
+ * Returns:
+ * Inject_Policy
+ */
+static Inject_Policy getInjectPolicy(request_rec *r) {
+    Inject_Policy policy = inject_default;
+    const char *value = apr_table_get(r->headers_out, CSRFP_INJECT_HEADER);
+    if (value == NULL) {
+        value = apr_table_get(r->err_headers_out, CSRFP_INJECT_HEADER);
+    }
+
+    if (value) {
+        if (!strcasecmp(value, "off")) policy = inject_off;
+        else if (!strcasecmp(value, "on")) policy = inject_on;
+
+        // Internal to server, not to be sent to client
+        apr_table_unset(r->headers_out, CSRFP_INJECT_HEADER);
+        apr_table_unset(r->err_headers_out, CSRFP_INJECT_HEADER);
+    }
+
+    if (policy == inject_default) {
+        const char *cc = apr_table_get(r->headers_out, "Cache-Control");
+        const char *ecc = apr_table_get(r->err_headers_out, "Cache-Control");
+        if ((cc && ap_find_token(r->pool, cc, "no-transform"))
+            || (ecc && ap_find_token(r->pool, ecc, "no-transform"))) {
+            policy = inject_off;
+        }
+    }
+    return policy;
+}
+
+/*
+ * Function: isBodilessResponse
+ * Function to decide if response carries no (complete) html body,
+ * i.e. HEAD request, 204, 304 or a partial (206, Content-Range) response
+ *
+ * Parametes:
+ * r - request_rec object
+ *
+ * Returns:
+ * int, 1 if response has no body to scan, 0 otherwise
+ */
+static int isBodilessResponse(request_rec *r) {
+    if (r->header_only
+        || r->status == HTTP_NO_CONTENT
+        || r->status == HTTP_NOT_MODIFIED
+        || r->status == HTTP_PARTIAL_CONTENT) {
+        return 1;
+    }
+
+    // Partial content set by the handler itself
+    if (apr_table_get(r->headers_out, "Content-Range")) {
+        return 1;
+    }
+    return 0;
+}
 
 /*
  * Function: csrfp_get_rctx
@@ -504,26 +1439,14 @@ static csrfp_opf_ctx *csrfp_get_rctx(request_rec *r) {
   if(rctx == NULL) {
     csrfp_config *conf = ap_get_module_config(r->server->module_config,
                                                 &csrf_protector_module);
+    const csrfp_policy *policy = csrfp_get_policy(r);
 
     rctx = apr_pcalloc(r->pool, sizeof(csrfp_opf_ctx));
     rctx->state = op_init;
     rctx->search = apr_psprintf(r->pool, "<body");
 
-    // Allocate memory and init <noscript> content to be injected
-    rctx->noscript = apr_psprintf(r->pool, "\n<noscript>\n%s\n</noscript>",
-                                conf->disablesJsMessage);
-
-    // Parse the getRule linked list and generate the rule string to be appended to js
-    struct getRuleNode *p = getTop;
-    char *getRuleString = NULL;
-    while (p != NULL) {
-        if (getRuleString)
-            getRuleString = apr_pstrcat(r->pool, getRuleString, ",'" , p->patternString , "'", NULL);
-        else
-            getRuleString = apr_pstrcat(r->pool, "'" , p->patternString , "'", NULL);
-
-        p = p->next;
-    }
+    // <noscript> content to be injected, prebuilt in policy
+    rctx->noscript = (char *)policy->noscript;
 
     // Allocate memory and init <script> content to be injected
     rctx->script = apr_psprintf(r->pool, "\n<script type=\"text/javascript\""
@@ -534,11 +1457,16 @@ static csrfp_opf_ctx *csrfp_get_rctx(request_rec *r) {
                                "\t  CSRFP.CSRFP_TOKEN = '%s';\n"
                                "\t  csrfprotector_init();\n"
                                "}\n</script>\n",
-                                conf->jsFilePath,
-                                (getRuleString == NULL)?"": getRuleString,
+                                policy->jsFilePath,
+                                policy->getRuleString,
                                 conf->tokenName);
 
     rctx->clstate = nmodified;
+    rctx->tokenIssued = CSRFP_FALSE;
+    rctx->spooling = CSRFP_FALSE;
+    rctx->spool = NULL;
+    rctx->markerMatched = 0;
+    rctx->markerFail = NULL;
     rctx->overlap_buf = apr_pcalloc(r->pool, CSRFP_OVERLAP_BUCKET_SIZE);
     apr_cpystrn(rctx->overlap_buf,
         CSRFP_OVERLAP_BUCKET_DEFAULT, CSRFP_OVERLAP_BUCKET_SIZE);
@@ -593,6 +1521,223 @@ static apr_bucket *csrfp_inject(request_rec *r, apr_bucket_brigade *bb, apr_buck
     return b;
 }
 
+/*
+ * Function: csrfp_bucket_read
+ * Reads a bucket without blocking if possible. If generator has nothing
+ * ready yet (pipe, socket), spooling is given up and what was scanned so
+ * far is sent with a FLUSH before waiting, so that client isn't kept
+ * waiting on the filter
+ *
+ * Parametes:
+ * f - apache filter object
+ * bb - bucket_brigade object, b belongs to it
+ * b - bucket to be read
+ * rctx - Request context
+ * buf, nbytes - set to contents of the bucket
+ *
+ * Returns:
+ * apr_status_t code
+ */
+static apr_status_t csrfp_bucket_read(ap_filter_t *f, apr_bucket_brigade *bb,
+                                    apr_bucket *b, csrfp_opf_ctx *rctx,
+                                    const char **buf, apr_size_t *nbytes)
+{
+    apr_bucket_brigade *rest;
+    apr_status_t rv = apr_bucket_read(b, buf, nbytes, APR_NONBLOCK_READ);
+    if (!APR_STATUS_IS_EAGAIN(rv)) {
+        return rv;
+    }
+
+    if (rctx->spooling == CSRFP_TRUE) {
+        // Don't hold back a slow generator, what was spooled goes
+        // first and the response is sent chunked
+        rctx->spooling = CSRFP_FALSE;
+        rv = ap_pass_brigade(f->next, rctx->spool);
+        apr_brigade_cleanup(rctx->spool);
+        if (rv != APR_SUCCESS) {
+            return rv;
+        }
+    }
+
+    rest = apr_brigade_split(bb, b);
+    APR_BRIGADE_INSERT_TAIL(bb, apr_bucket_flush_create(f->c->bucket_alloc));
+    rv = ap_pass_brigade(f->next, bb);
+    apr_brigade_cleanup(bb);
+    APR_BRIGADE_CONCAT(bb, rest);
+    apr_brigade_destroy(rest);
+    if (rv != APR_SUCCESS) {
+        return rv;
+    }
+
+    return apr_bucket_read(b, buf, nbytes, APR_BLOCK_READ);
+}
+
+/*
+ * Function: csrfp_inject_at_marker
+ * Searches brigade for application supplied injectionMarker and injects
+ * <noscript> and <script> right after it, in one go. Marker may be split
+ * across buckets, bytes matched so far are carried in rctx as KMP state
+ *
+ * Parametes:
+ * f - apache filter object
+ * bb - bucket_brigade object
+ * rctx - Request context containing the state of the parser
+ * marker - injectionMarker
+ *
+ * Returns:
+ * void
+ */
+static void csrfp_inject_at_marker(ap_filter_t *f, apr_bucket_brigade *bb,
+                                    csrfp_opf_ctx *rctx, const char *marker)
+{
+    request_rec *r = f->r;
+    apr_size_t markerlen = strlen(marker);
+    apr_size_t *fail = rctx->markerFail;
+    apr_bucket *b;
+
+    if (fail == NULL) {
+        apr_size_t i, k = 0;
+        fail = rctx->markerFail = apr_pcalloc(r->pool, markerlen * sizeof(*fail));
+        for (i = 1; i < markerlen; i++) {
+            while (k > 0 && marker[i] != marker[k]) {
+                k = fail[k - 1];
+            }
+            if (marker[i] == marker[k]) {
+                ++k;
+            }
+            fail[i] = k;
+        }
+    }
+
+    for (b = APR_BRIGADE_FIRST(bb); b != APR_BRIGADE_SENTINEL(bb); b = APR_BUCKET_NEXT(b)) {
+        const char *buf, *hit;
+        apr_size_t nbytes, sz, i, head, matched;
+
+        if (APR_BUCKET_IS_METADATA(b)
+            || csrfp_bucket_read(f, bb, b, rctx, &buf, &nbytes) != APR_SUCCESS
+            || nbytes == 0) {
+            continue;
+        }
+
+        // A marker started in previous bucket ends within the first
+        // markerlen - 1 bytes, feed them through the carried KMP state
+        matched = rctx->markerMatched;
+        head = (nbytes < markerlen - 1) ? nbytes : markerlen - 1;
+        for (i = 0; i < head; i++) {
+            matched = csrfp_marker_step(marker, fail, matched, buf[i]);
+            if (matched == markerlen) {
+                sz = i + 1;
+                goto found;
+            }
+        }
+
+        hit = csrfp_memmem(buf, nbytes, marker, markerlen);
+        if (hit) {
+            sz = (hit - buf) + markerlen;
+            goto found;
+        }
+
+        // Otherwise state only depends on the last markerlen - 1 bytes
+        if (nbytes > head) {
+            matched = 0;
+            for (i = nbytes - (markerlen - 1); i < nbytes; i++) {
+                matched = csrfp_marker_step(marker, fail, matched, buf[i]);
+            }
+        }
+        rctx->markerMatched = matched;
+        continue;
+
+        found:
+        if (sz < nbytes) {
+            apr_bucket_split(b, sz);
+        }
+        APR_BUCKET_INSERT_AFTER(b, apr_bucket_pool_create(rctx->script,
+                            strlen(rctx->script), r->pool, bb->bucket_alloc));
+        APR_BUCKET_INSERT_AFTER(b, apr_bucket_pool_create(rctx->noscript,
+                            strlen(rctx->noscript), r->pool, bb->bucket_alloc));
+        rctx->state = op_body_end;
+        rctx->search = NULL;
+        return;
+    }
+}
+
+/*
+ * Function: csrfp_spool_brigade
+ * Holds back html response till EOS so that exact Content-Length can
+ * be sent, gives up and passes it as chunked response once spoolSize
+ * is exceeded, generator asks for a FLUSH or has nothing ready yet
+ *
+ * Parametes:
+ * f - apache filter object
+ * rctx - Request context containing the spool
+ * bb - brigade to be spooled
+ *
+ * Returns:
+ * apr_status_t code
+ */
+static apr_status_t csrfp_spool_brigade(ap_filter_t *f, csrfp_opf_ctx *rctx,
+                                    apr_bucket_brigade *bb)
+{
+    request_rec *r = f->r;
+    csrfp_config *conf = ap_get_module_config(r->server->module_config,
+                                                &csrf_protector_module);
+    apr_bucket *b;
+    apr_off_t length = 0;
+    int eos = 0, hold = 1;
+    apr_status_t rv;
+
+    if (!APR_BRIGADE_EMPTY(bb)) {
+        eos = APR_BUCKET_IS_EOS(APR_BRIGADE_LAST(bb));
+    }
+
+    // Only buckets of known length are ever spooled
+    apr_brigade_length(rctx->spool, 0, &length);
+
+    // Sum up bucket by bucket, buckets of unknown length (pipes, sockets)
+    // are read without blocking & only while within spoolSize, so that
+    // a long (or slow) generator isn't read into memory as a whole
+    for (b = APR_BRIGADE_FIRST(bb); b != APR_BRIGADE_SENTINEL(bb); b = APR_BUCKET_NEXT(b)) {
+        if (APR_BUCKET_IS_FLUSH(b)) {
+            hold = 0;
+            break;
+        }
+        if (APR_BUCKET_IS_METADATA(b)) {
+            continue;
+        }
+        if (b->length == (apr_size_t)-1) {
+            const char *buf;
+            apr_size_t nbytes;
+            if (length > conf->spoolSize
+                || apr_bucket_read(b, &buf, &nbytes, APR_NONBLOCK_READ) != APR_SUCCESS) {
+                hold = 0;
+                break;
+            }
+        }
+        length += b->length;
+    }
+
+    if (hold && eos) {
+        // Whole response is here, send it with exact length
+        ap_set_content_length(r, length);
+    } else if (hold && length <= conf->spoolSize) {
+        // Keep holding back, everything read is in memory by now
+        return ap_save_brigade(f, &rctx->spool, &bb, r->pool);
+    }
+    // else: too large or streamed, Content-Length is already unset
+    // so core sends it chunked (or closes the connection for HTTP/1.0)
+
+    rctx->spooling = CSRFP_FALSE;
+    APR_BRIGADE_CONCAT(rctx->spool, bb);
+    rv = ap_pass_brigade(f->next, rctx->spool);
+    apr_brigade_cleanup(rctx->spool);
+
+    if (rctx->state == op_body_end
+        || rctx->state == op_end) {
+        ap_remove_output_filter(f);
+    }
+    return rv;
+}
+
 /*
  * Function: logCSRFAttack
  * Function to log an attack
@@ -604,21 +1749,72 @@ static apr_bucket *csrfp_inject(request_rec *r, apr_bucket_brigade *bb, apr_buck
  * void
  */
 static void logCSRFAttack(request_rec *r)
+{
+    if (apr_table_get(r->notes, CSRFP_DUPLICATE_NOTE)) {
+        // Counted in negative cache, summary logged on eviction
+        return;
+    }
+
+    // Queued, rate limited per client, written by attack log writer
+    csrfp_attacklog_push(r, log_attack, 0);
+}
+
+/*
+ * Function: refuseRequestBody
+ * Makes sure request body of a failed request is never transmitted.
+ * Client sending 'Expect: 100-continue' waits for 100 Continue before
+ * uploading, which is sent as soon as someone reads the body, so
+ * body is declared empty and connection is not reused, instead.
+ *
+ * Parameters:
+ * r - request_rec object
+ *
+ * Returns:
+ * void
+ */
+static void refuseRequestBody(request_rec *r)
+{
+    if (!r->expecting_100) {
+        return;
+    }
+
+    apr_table_unset(r->headers_in, "Content-Length");
+    apr_table_unset(r->headers_in, "Transfer-Encoding");
+    r->expecting_100 = 0;
+
+    // Client might still send the body (on timeout), it shall not
+    // be mistaken for the next request on this connection
+    r->connection->keepalive = AP_CONN_CLOSE;
+}
+
+/*
+ * Function: throttledAction
+ * Returns status code for a client which exceeded its failure budget,
+ * nothing is validated nor logged for it
+ *
+ * Parameters:
+ * r - request_rec object
+ *
+ * Returns:  
+ * int - status code for action
+ */
+static int throttledAction(request_rec *r)
 {
     csrfp_config *conf = ap_get_module_config(r->server->module_config,
                                                 &csrf_protector_module);
 
-    int isGet = (!strcmp(r->method, "GET"));
-    const char *POSTArgs;   //#todo a way to log POST arguments
-    // Log the failure
-    ap_log_rerror(APLOG_MARK, APLOG_NOERRNO|APLOG_ERR, 0, r,
-                      "CSRF ATTACK, %s, action=%d, method=%s, arguments=%s, url=%s%s", 
-                      conf->action == strip ? "strip & served" : "denied",
-                      conf->action,
-                      (isGet)? "GET" : "POST",
-                      (isGet)? r->args: "POSTArgs", //remove ""
-                      "https(s)://",
-                      getCurrentUrl(r));
+    refuseRequestBody(r);
+    r->connection->keepalive = AP_CONN_CLOSE;
+
+    if (conf->throttleAction == throttle_drop) {
+        // Nothing is sent, connection is closed
+        r->connection->aborted = 1;
+        return DONE;
+    }
+
+    // Not known to older status line tables
+    r->status_line = "429 Too Many Requests";
+    return HTTP_TOO_MANY_REQUESTS;
 }
 
 /*
@@ -634,12 +1830,18 @@ static void logCSRFAttack(request_rec *r)
  */
 static int failedValidationAction(request_rec *r)
 {
-    csrfp_config *conf = ap_get_module_config(r->server->module_config,
-                                                &csrf_protector_module);
+    const csrfp_policy *policy = csrfp_get_policy(r);
     
+    // Charge the client's failure budget
+    csrfp_throttle(r, 1);
+
     logCSRFAttack(r);   // Log this attack
 
-    switch (conf->action)
+    // Decision was made from headers & query alone, don't
+    // let the client upload a body that is going to be thrown away
+    refuseRequestBody(r);
+
+    switch (policy->action)
     {
         case forbidden:
             return HTTP_FORBIDDEN;
@@ -657,8 +1859,8 @@ static int failedValidationAction(request_rec *r)
             break;
         case redirect:
             // Redirect to custom uri
-            if (strlen(conf->errorRedirectionUri) > 0) {
-                apr_table_add(r->headers_out, "Location", conf->errorRedirectionUri);
+            if (strlen(policy->errorRedirectionUri) > 0) {
+                apr_table_add(r->headers_out, "Location", policy->errorRedirectionUri);
                 return HTTP_MOVED_PERMANENTLY;
             } else {
                 return HTTP_FORBIDDEN;
@@ -666,7 +1868,7 @@ static int failedValidationAction(request_rec *r)
             break;
         case message:
             // Show custom Error Message
-            ap_rprintf(r, "<h2>%s</h2>", conf->errorCustomMessage);
+            ap_rprintf(r, "<h2>%s</h2>", policy->errorCustomMessage);
             return DONE;
             break;
         case internal_server_error:
@@ -713,65 +1915,1163 @@ static int needvalidation(request_rec *r)
 }
 
 //=============================================================
-// All SQLite related functions
+// Negative cache of failed validations
 //=============================================================
 
 /*
- * Function: csrfp_sql_init
- * Function to initiate the sql process for code validation
+ * Function: csrfp_pair_hash
+ * Function to hash (sessid, token) pair into a negative cache key, FNV-1a
  *
  * Parameters: 
- * r - request_rec object
+ * sessid - session id sent by client
+ * token - token sent by client
  *
  * Returns: 
- * db, SQLITE database object on success
+ * apr_uint64_t, non zero key
  */
-static sqlite3 *csrfp_sql_init(request_rec *r)
+static apr_uint64_t csrfp_pair_hash(const char *sessid, const char *token)
 {
-    csrfp_config *conf = ap_get_module_config(r->server->module_config,
-                                                &csrf_protector_module);
+    apr_uint64_t hash = 14695981039346656037ULL;
+    const char *p;
 
-    sqlite3 *db;
-    int rc = sqlite3_open_v2(DATABASE_DEFAULT_LOCATION, &db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, NULL);
-    if (rc != SQLITE_OK) {
-        #ifdef DEBUG
-            apr_table_addn(r->headers_out, "sql-init-open-error", sqlite3_errmsg(db));
-        #endif
-        return NULL;
+    for (p = sessid; *p; p++) {
+        hash = (hash ^ (unsigned char)*p) * 1099511628211ULL;
+    }
+    // separator, so that ('ab', 'c') & ('a', 'bc') differ
+    hash = (hash ^ 0xff) * 1099511628211ULL;
+    for (p = token; *p; p++) {
+        hash = (hash ^ (unsigned char)*p) * 1099511628211ULL;
+    }
+    return hash ? hash : 1;
+}
+
+/*
+ * Function: csrfp_negcache_hit
+ * Function to check if pair failed validation recently, counts the repeat
+ *
+ * Parameters: 
+ * r - request_rec object
+ * key - hash of the pair
+ *
+ * Returns: 
+ * int, 1 if pair is in the cache, 0 otherwise
+ */
+static int csrfp_negcache_hit(request_rec *r, apr_uint64_t key)
+{
+    int hit = 0;
+    if (negCache == NULL) {
+        return 0;
+    }
+
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(negCacheMutex);
+#endif
+    csrfp_neg_entry *e = &negCache[key % negCacheSize];
+    if (e->key == key && e->expiry > apr_time_now()) {
+        ++e->suppressed;
+        hit = 1;
+    }
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(negCacheMutex);
+#endif
+    return hit;
+}
+
+/*
+ * Function: csrfp_negcache_add
+ * Function to remember a failed pair, logs how many repeats of
+ * the pair being evicted were suppressed
+ *
+ * Parameters: 
+ * r - request_rec object
+ * key - hash of the pair
+ *
+ * Returns: 
+ * void
+ */
+static void csrfp_negcache_add(request_rec *r, apr_uint64_t key)
+{
+    csrfp_config *conf = ap_get_module_config(r->server->module_config,
+                                                &csrf_protector_module);
+    const char *client = CSRFP_CLIENT_IP(r);
+    int suppressed = 0;
+    if (negCache == NULL) {
+        return;
+    }
+
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(negCacheMutex);
+#endif
+    csrfp_neg_entry *e = &negCache[key % negCacheSize];
+    suppressed = e->suppressed;
+    e->key = key;
+    e->expiry = apr_time_now() + apr_time_from_sec(conf->negCacheTTL);
+    e->suppressed = 0;
+    e->server = r->server;
+    apr_cpystrn(e->client, client ? client : "-", sizeof(e->client));
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(negCacheMutex);
+#endif
+
+    if (suppressed > 0) {
+        csrfp_attacklog_push(r, log_repeated, suppressed);
+    }
+}
+
+/*
+ * Function: csrfp_negcache_report
+ * Child pool cleanup, logs repeats still counted in the negative cache
+ * which would otherwise be lost with the child
+ *
+ * Parameters: 
+ * data - server_rec object
+ *
+ * Returns: 
+ * apr_status_t
+ */
+static apr_status_t csrfp_negcache_report(void *data)
+{
+    int i;
+    if (negCache == NULL) {
+        return APR_SUCCESS;
+    }
+
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(negCacheMutex);
+#endif
+    for (i = 0; i < negCacheSize; i++) {
+        csrfp_neg_entry *e = &negCache[i];
+        if (e->suppressed > 0) {
+            // Written right away, attack log writer may be gone by now
+            csrfp_attack_record rec;
+            memset(&rec, 0, sizeof(rec));
+            rec.kind = log_repeated;
+            rec.server = e->server ? e->server : data;
+            rec.count = e->suppressed;
+            apr_cpystrn(rec.client, e->client, sizeof(rec.client));
+            csrfp_attacklog_write(&rec);
+            e->suppressed = 0;
+        }
+    }
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(negCacheMutex);
+#endif
+    return APR_SUCCESS;
+}
+
+//=============================================================
+// Token cache
+//=============================================================
+
+/*
+ * Function: csrfp_tokencache_find
+ * Looks sessid up in the token cache, caller holds tokenCacheMutex
+ *
+ * Parameters: 
+ * sessid - session id
+ * bucket - set to hash bucket of sessid
+ *
+ * Returns: 
+ * index of the entry, -1 if not cached
+ */
+static int csrfp_tokencache_find(const char *sessid, int *bucket)
+{
+    int i;
+    *bucket = (int)(csrfp_pair_hash(sessid, "") % tokenCacheSize);
+    for (i = tokenCacheBuckets[*bucket]; i != -1; i = tokenCache[i].hnext) {
+        if (!strcmp(tokenCache[i].sessid, sessid)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Function: csrfp_tokencache_unhash
+ * Removes entry from its hash chain & marks it free, caller holds
+ * tokenCacheMutex
+ *
+ * Parameters: 
+ * i - index of the entry
+ *
+ * Returns: 
+ * void
+ */
+static void csrfp_tokencache_unhash(int i)
+{
+    int bucket, *link;
+    if (tokenCache[i].sessid[0] == '\0') {
+        return;
+    }
+    bucket = (int)(csrfp_pair_hash(tokenCache[i].sessid, "") % tokenCacheSize);
+    for (link = &tokenCacheBuckets[bucket]; *link != -1; link = &tokenCache[*link].hnext) {
+        if (*link == i) {
+            *link = tokenCache[i].hnext;
+            break;
+        }
+    }
+    tokenCache[i].sessid[0] = '\0';
+    tokenCache[i].hnext = -1;
+}
+
+/*
+ * Function: csrfp_tokencache_touch
+ * Moves entry to the front (most recently used end) of the LRU list,
+ * caller holds tokenCacheMutex
+ *
+ * Parameters: 
+ * i - index of the entry
+ *
+ * Returns: 
+ * void
+ */
+static void csrfp_tokencache_touch(int i)
+{
+    csrfp_token_entry *e = &tokenCache[i];
+    if (tokenCacheHead == i) {
+        return;
+    }
+
+    // unlink
+    if (e->prev != -1) tokenCache[e->prev].next = e->next;
+    if (e->next != -1) tokenCache[e->next].prev = e->prev;
+    if (tokenCacheTail == i) tokenCacheTail = e->prev;
+
+    // push front
+    e->prev = -1;
+    e->next = tokenCacheHead;
+    if (tokenCacheHead != -1) tokenCache[tokenCacheHead].prev = i;
+    tokenCacheHead = i;
+    if (tokenCacheTail == -1) tokenCacheTail = i;
+}
+
+/*
+ * Function: csrfp_tokencache_match
+ * Checks value against token cached for sessid, in constant time
+ *
+ * Parameters: 
+ * sessid - session id
+ * value - token sent by client
+ *
+ * Returns: 
+ * 1 if cached token matches, 0 otherwise (store has to be asked,
+ * another child may have issued a newer token)
+ */
+static int csrfp_tokencache_match(const char *sessid, const char *value)
+{
+    int i, bucket, hit = 0;
+    if (tokenCache == NULL) {
+        return 0;
+    }
+
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(tokenCacheMutex);
+#endif
+    i = csrfp_tokencache_find(sessid, &bucket);
+    if (i != -1) {
+        if (tokenCache[i].expiry < apr_time_now()) {
+            csrfp_tokencache_unhash(i);
+        } else {
+            hit = csrfp_token_equals(tokenCache[i].token, value);
+            csrfp_tokencache_touch(i);
+        }
+    }
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(tokenCacheMutex);
+#endif
+    return hit;
+}
+
+/*
+ * Function: csrfp_tokencache_issued
+ * Gets issue time of token, if it is the one cached for sessid
+ *
+ * Parameters: 
+ * sessid - session id
+ * token - token held by client
+ * issued - set to time token was issued
+ *
+ * Returns: 
+ * 1 if token is cached for sessid, 0 otherwise
+ */
+static int csrfp_tokencache_issued(const char *sessid, const char *token, apr_time_t *issued)
+{
+    int i, bucket, hit = 0;
+    if (tokenCache == NULL) {
+        return 0;
+    }
+
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(tokenCacheMutex);
+#endif
+    i = csrfp_tokencache_find(sessid, &bucket);
+    if (i != -1 && tokenCache[i].expiry >= apr_time_now()
+        && csrfp_token_equals(tokenCache[i].token, token)) {
+        *issued = tokenCache[i].issued;
+        hit = 1;
+    }
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(tokenCacheMutex);
+#endif
+    return hit;
+}
+
+/*
+ * Function: csrfp_tokencache_use
+ * Counts a validation passed with token cached for sessid
+ *
+ * Parameters: 
+ * sessid - session id
+ *
+ * Returns: 
+ * no of validations passed in this child, 0 if not cached
+ */
+static int csrfp_tokencache_use(const char *sessid)
+{
+    int i, bucket, uses = 0;
+    if (tokenCache == NULL) {
+        return 0;
+    }
+
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(tokenCacheMutex);
+#endif
+    i = csrfp_tokencache_find(sessid, &bucket);
+    if (i != -1) {
+        uses = ++tokenCache[i].uses;
+    }
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(tokenCacheMutex);
+#endif
+    return uses;
+}
+
+/*
+ * Function: csrfp_tokencache_put
+ * Caches token of sessid, replacing the one cached before (rotation),
+ * least recently used entry is evicted if cache is full
+ *
+ * Parameters: 
+ * sessid - session id
+ * token - token in store for sessid
+ * issued - time token was issued
+ *
+ * Returns: 
+ * void
+ */
+static void csrfp_tokencache_put(const char *sessid, const char *token, apr_time_t issued)
+{
+    int i, bucket;
+    if (tokenCache == NULL) {
+        return;
+    }
+
+    // Bound staleness, token may be rotated by another child meanwhile
+    apr_time_t expiry = issued + apr_time_from_sec(TOKEN_EXPIRY_MAXTIME);
+    apr_time_t maxExpiry = apr_time_now() + apr_time_from_sec(CSRFP_TOKEN_CACHE_MAXAGE);
+    if (expiry > maxExpiry) {
+        expiry = maxExpiry;
+    }
+
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(tokenCacheMutex);
+#endif
+    i = csrfp_tokencache_find(sessid, &bucket);
+    if (i == -1) {
+        // Reuse least recently used entry
+        i = tokenCacheTail;
+        csrfp_tokencache_unhash(i);
+        apr_cpystrn(tokenCache[i].sessid, sessid, sizeof(tokenCache[i].sessid));
+        tokenCache[i].hnext = tokenCacheBuckets[bucket];
+        tokenCacheBuckets[bucket] = i;
+        tokenCache[i].token[0] = '\0';
+    }
+    if (strlen(token) < sizeof(tokenCache[i].token)) {
+        if (strcmp(tokenCache[i].token, token)) {
+            // New token, uses start over
+            apr_cpystrn(tokenCache[i].token, token, sizeof(tokenCache[i].token));
+            tokenCache[i].uses = 0;
+        }
+        tokenCache[i].expiry = expiry;
+        tokenCache[i].issued = issued;
+        csrfp_tokencache_touch(i);
+    } else {
+        // Too long to cache, never serve a stale one instead
+        csrfp_tokencache_unhash(i);
+    }
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(tokenCacheMutex);
+#endif
+}
+
+//=============================================================
+// Attack log
+//=============================================================
+
+/*
+ * Function: csrfp_attacklog_write
+ * Function to write one attack log record to error log
+ *
+ * Parameters: 
+ * rec - attack log record
+ *
+ * Returns: 
+ * void
+ */
+static void csrfp_attacklog_write(const csrfp_attack_record *rec)
+{
+    switch (rec->kind)
+    {
+        case log_attack:
+            ap_log_error(APLOG_MARK, APLOG_NOERRNO|APLOG_ERR, 0, rec->server,
+                      "CSRF ATTACK, %s, action=%d, method=%s, client=%s, arguments=%s, url=%s%s",
+                      rec->action == strip ? "strip & served" : "denied",
+                      rec->action,
+                      rec->method,
+                      rec->client,
+                      rec->args,
+                      "https(s)://",
+                      rec->url);
+            break;
+        case log_repeated:
+            ap_log_error(APLOG_MARK, APLOG_NOERRNO|APLOG_ERR, 0, rec->server,
+                      "CSRF ATTACK, client=%s, %d repeated failures suppressed",
+                      rec->client, rec->count);
+            break;
+        case log_rate_limited:
+            ap_log_error(APLOG_MARK, APLOG_NOERRNO|APLOG_ERR, 0, rec->server,
+                      "CSRF ATTACK, client=%s, %d more suppressed",
+                      rec->client, rec->count);
+            break;
+    }
+}
+
+/*
+ * Function: csrfp_attacklog_enqueue
+ * Function to add a record to the ring, or write it right away if there
+ * is no writer thread. Caller holds attackLogMutex
+ *
+ * Parameters: 
+ * rec - attack log record
+ *
+ * Returns: 
+ * void
+ */
+static void csrfp_attacklog_enqueue(const csrfp_attack_record *rec)
+{
+#if APR_HAS_THREADS
+    if (attackLogThread) {
+        if (attackLogHead - attackLogTail >= CSRFP_ATTACK_LOG_RING) {
+            // Writer can't keep up, count it instead
+            ++attackLogDropped;
+        } else {
+            attackLog[attackLogHead % CSRFP_ATTACK_LOG_RING] = *rec;
+            ++attackLogHead;
+        }
+        return;
+    }
+#endif
+    csrfp_attacklog_write(rec);
+}
+
+/*
+ * Function: csrfp_attacklog_flush_slot
+ * Function to report records suppressed for a client, as one aggregate.
+ * Caller holds attackLogMutex
+ *
+ * Parameters: 
+ * slot - rate limit slot of the client
+ *
+ * Returns: 
+ * void
+ */
+static void csrfp_attacklog_flush_slot(csrfp_rate_slot *slot)
+{
+    if (slot->suppressed > 0) {
+        csrfp_attack_record rec;
+        memset(&rec, 0, sizeof(rec));
+        rec.kind = log_rate_limited;
+        rec.server = slot->server;
+        rec.count = slot->suppressed;
+        apr_cpystrn(rec.client, slot->client, sizeof(rec.client));
+        csrfp_attacklog_enqueue(&rec);
+        slot->suppressed = 0;
+    }
+}
+
+/*
+ * Function: csrfp_attacklog_push
+ * Function to log an attack without blocking the request on log I/O.
+ * Records are rate limited per client, and escaped & truncated
+ *
+ * Parameters: 
+ * r - request_rec object
+ * kind - kind of the record
+ * count - no of suppressed records, for aggregates
+ *
+ * Returns: 
+ * void
+ */
+static void csrfp_attacklog_push(request_rec *r, Attack_Log_Kind kind, int count)
+{
+    csrfp_config *conf = ap_get_module_config(r->server->module_config,
+                                                &csrf_protector_module);
+    const csrfp_policy *policy = csrfp_get_policy(r);
+    csrfp_attack_record rec;
+    const char *client = CSRFP_CLIENT_IP(r);
+
+    memset(&rec, 0, sizeof(rec));
+    rec.kind = kind;
+    rec.server = r->server;
+    rec.action = policy->action;
+    rec.count = count;
+    apr_cpystrn(rec.client, client ? client : "-", sizeof(rec.client));
+    apr_cpystrn(rec.method, r->method, sizeof(rec.method));
+    apr_cpystrn(rec.url, ap_escape_logitem(r->pool, getCurrentUrl(r)), sizeof(rec.url));
+    apr_cpystrn(rec.args, r->args ? ap_escape_logitem(r->pool, r->args) : "-",
+                sizeof(rec.args));
+
+#if APR_HAS_THREADS
+    if (attackLogMutex) apr_thread_mutex_lock(attackLogMutex);
+#endif
+    if (attackRate && conf->attackLogRate > 0 && kind == log_attack) {
+        apr_uint64_t key = csrfp_pair_hash(rec.client, "");
+        apr_time_t now = apr_time_sec(apr_time_now());
+        csrfp_rate_slot *slot = &attackRate[key % CSRFP_ATTACK_LOG_SLOTS];
+
+        if (slot->key != key || slot->window != now) {
+            // New second or other client, report what was held back
+            csrfp_attacklog_flush_slot(slot);
+            slot->key = key;
+            slot->window = now;
+            slot->count = 0;
+            slot->server = r->server;
+            apr_cpystrn(slot->client, rec.client, sizeof(slot->client));
+        }
+
+        if (++slot->count > conf->attackLogRate) {
+            ++slot->suppressed;
+            kind = log_rate_limited;
+        }
+    }
+
+    if (kind != log_rate_limited) {
+        csrfp_attacklog_enqueue(&rec);
+    }
+#if APR_HAS_THREADS
+    if (attackLogMutex) {
+        if (attackLogThread) apr_thread_cond_signal(attackLogCond);
+        apr_thread_mutex_unlock(attackLogMutex);
+    }
+#endif
+}
+
+#if APR_HAS_THREADS
+/*
+ * Function: csrfp_attacklog_drain
+ * Function to write out queued records, and aggregates of clients whose
+ * second is over. Called with attackLogMutex held, released while writing
+ *
+ * Parameters: 
+ * void
+ *
+ * Returns: 
+ * void
+ */
+static void csrfp_attacklog_drain(void)
+{
+    apr_time_t now = apr_time_sec(apr_time_now());
+    int i;
+
+    for (i = 0; i < CSRFP_ATTACK_LOG_SLOTS; i++) {
+        if (attackRate[i].window < now) {
+            csrfp_attacklog_flush_slot(&attackRate[i]);
+        }
+    }
+
+    while (attackLogTail != attackLogHead) {
+        csrfp_attack_record rec = attackLog[attackLogTail % CSRFP_ATTACK_LOG_RING];
+        ++attackLogTail;
+        apr_thread_mutex_unlock(attackLogMutex);
+        csrfp_attacklog_write(&rec);
+        apr_thread_mutex_lock(attackLogMutex);
+    }
+
+    if (attackLogDropped > 0) {
+        int dropped = attackLogDropped;
+        server_rec *s = attackLog[0].server;
+        attackLogDropped = 0;
+        apr_thread_mutex_unlock(attackLogMutex);
+        ap_log_error(APLOG_MARK, APLOG_NOERRNO|APLOG_ERR, 0, s,
+                     "CSRF ATTACK, %d records dropped, attack log full", dropped);
+        apr_thread_mutex_lock(attackLogMutex);
+    }
+}
+
+/*
+ * Function: csrfp_attacklog_writer
+ * Attack log writer thread, wakes up on new records or every second
+ *
+ * Parameters: 
+ * thd - this thread
+ * data - unused
+ *
+ * Returns: 
+ * NULL
+ */
+static void * APR_THREAD_FUNC csrfp_attacklog_writer(apr_thread_t *thd, void *data)
+{
+    apr_thread_mutex_lock(attackLogMutex);
+    while (!attackLogStop) {
+        if (attackLogTail == attackLogHead) {
+            apr_thread_cond_timedwait(attackLogCond, attackLogMutex,
+                                      apr_time_from_sec(1));
+        }
+        csrfp_attacklog_drain();
+    }
+    csrfp_attacklog_drain();
+    apr_thread_mutex_unlock(attackLogMutex);
+
+    apr_thread_exit(thd, APR_SUCCESS);
+    return NULL;
+}
+
+/*
+ * Function: csrfp_attacklog_stop
+ * Child pool cleanup, stops writer thread once queued records are written
+ *
+ * Parameters: 
+ * data - unused
+ *
+ * Returns: 
+ * apr_status_t
+ */
+static apr_status_t csrfp_attacklog_stop(void *data)
+{
+    apr_status_t rv;
+    apr_thread_t *thd = attackLogThread;
+
+    apr_thread_mutex_lock(attackLogMutex);
+    attackLogStop = 1;
+    apr_thread_cond_signal(attackLogCond);
+    apr_thread_mutex_unlock(attackLogMutex);
+
+    apr_thread_join(&rv, thd);
+
+    // Anything logged from now on is written inline
+    attackLogThread = NULL;
+    return APR_SUCCESS;
+}
+#endif
+
+//=============================================================
+// Failed validation throttle
+//=============================================================
+
+/*
+ * Function: csrfp_throttle
+ * Function to refill the client's token bucket and optionally charge
+ * a failed validation to it. Buckets live in shared memory, so budget
+ * holds across children
+ *
+ * Parameters: 
+ * r - request_rec object
+ * charge - 1 to charge a failure, 0 to only check
+ *
+ * Returns: 
+ * int, 1 if client is over budget, 0 otherwise
+ */
+static int csrfp_throttle(request_rec *r, int charge)
+{
+    csrfp_config *conf = ap_get_module_config(r->server->module_config,
+                                                &csrf_protector_module);
+    const char *client = NULL;
+    int throttled = 0;
+
+    if (throttleTable == NULL || conf->throttleRate <= 0) {
+        return 0;
+    }
+
+    if (conf->throttleKey == throttle_key_session) {
+        client = getCookieToken(r, CSRFP_SESS_TOKEN);
+    }
+    if (client == NULL) {
+        client = CSRFP_CLIENT_IP(r);
+    }
+    apr_uint64_t key = csrfp_pair_hash(client ? client : "-", "");
+
+    if (apr_global_mutex_lock(throttleMutex) != APR_SUCCESS) {
+        return 0;
+    }
+
+    csrfp_throttle_slot *slot = &throttleTable[key % CSRFP_THROTTLE_SLOTS];
+    apr_time_t now = apr_time_now();
+    long full = (long)conf->throttleBurst * CSRFP_THROTTLE_UNIT;
+
+    if (slot->key != key) {
+        // New client (or collision), starts with a full bucket
+        slot->key = key;
+        slot->last = now;
+        slot->tokens = full;
+    } else if (now > slot->last) {
+        apr_time_t refill = (now - slot->last) * conf->throttleRate
+                            * CSRFP_THROTTLE_UNIT / apr_time_from_sec(60);
+        if (refill > 0) {
+            slot->tokens = (slot->tokens + refill > full) ? full : slot->tokens + refill;
+            slot->last = now;
+        }
+    }
+
+    if (charge && slot->tokens > 0) {
+        slot->tokens -= CSRFP_THROTTLE_UNIT;
+    }
+    throttled = (slot->tokens < CSRFP_THROTTLE_UNIT);
+
+    apr_global_mutex_unlock(throttleMutex);
+    return throttled;
+}
+
+//=============================================================
+// All SQLite related functions
+//=============================================================
+
+/*
+ * Function: csrfp_sql_busy
+ * sqlite busy handler, sleeps with exponential backoff (and jitter, so
+ * that waiters don't retry in lock step) while store is locked by
+ * another connection, till deadline of the waiter runs out
+ *
+ * Parameters: 
+ * data - csrfp_busy_state object
+ * count - no of times handler was called for this lock
+ *
+ * Returns: 
+ * 1 to retry, 0 to give up with SQLITE_BUSY
+ */
+static int csrfp_sql_busy(void *data, int count)
+{
+    csrfp_busy_state *busy = data;
+    apr_time_t now = apr_time_now();
+    apr_interval_time_t backoff;
+
+    if (count == 0) {
+        apr_atomic_inc32(&storeBusyEvents);
+    }
+    if (now >= busy->deadline) {
+        apr_atomic_inc32(&storeBusyTimeouts);
+        busy->timedOut = 1;
+        return 0;
+    }
+
+    backoff = CSRFP_STORE_BACKOFF_MIN;
+    while (count-- > 0 && backoff < CSRFP_STORE_BACKOFF_MAX) {
+        backoff *= 2;
+    }
+    if (backoff > CSRFP_STORE_BACKOFF_MAX) {
+        backoff = CSRFP_STORE_BACKOFF_MAX;
+    }
+
+    // Anywhere in upper half of the backoff
+    busy->seed ^= busy->seed << 13;
+    busy->seed ^= busy->seed >> 17;
+    busy->seed ^= busy->seed << 5;
+    backoff = backoff / 2 + busy->seed % (backoff / 2 + 1);
+    if (backoff > busy->deadline - now) {
+        backoff = busy->deadline - now;
+    }
+    apr_sleep(backoff);
+
+    ++busy->waits;
+    apr_atomic_inc32(&storeBusyWaits);
+    return 1;
+}
+
+/*
+ * Function: csrfp_busy_start
+ * Starts waiting budget of storeBusyTimeout
+ *
+ * Parameters: 
+ * busy - csrfp_busy_state object
+ * conf - csrfp_config object
+ *
+ * Returns: 
+ * void
+ */
+static void csrfp_busy_start(csrfp_busy_state *busy, csrfp_config *conf)
+{
+    busy->deadline = apr_time_now() + apr_time_from_msec(conf->storeBusyTimeout);
+    busy->seed = (apr_uint32_t)(busy->deadline ^ (apr_uintptr_t)busy) | 1;
+    busy->waits = 0;
+    busy->timedOut = 0;
+}
+
+/*
+ * Function: csrfp_busy_state_of
+ * Waiting budget of the request, started by its first store access
+ *
+ * Parameters: 
+ * r - request_rec object
+ *
+ * Returns: 
+ * csrfp_busy_state object
+ */
+static csrfp_busy_state *csrfp_busy_state_of(request_rec *r)
+{
+    void *data = NULL;
+
+    apr_pool_userdata_get(&data, CSRFP_BUSY_KEY, r->pool);
+    if (data == NULL) {
+        csrfp_config *conf = ap_get_module_config(r->server->module_config,
+                                                    &csrf_protector_module);
+        data = apr_palloc(r->pool, sizeof(csrfp_busy_state));
+        csrfp_busy_start(data, conf);
+        apr_pool_userdata_setn(data, CSRFP_BUSY_KEY, NULL, r->pool);
+    }
+    return data;
+}
+
+/*
+ * Function: csrfp_busy_timed_out
+ * Tells if request gave up on a locked store
+ *
+ * Parameters: 
+ * r - request_rec object
+ *
+ * Returns: 
+ * 1 if storeBusyTimeout of the request ran out, 0 otherwise
+ */
+static int csrfp_busy_timed_out(request_rec *r)
+{
+    void *data = NULL;
+
+    apr_pool_userdata_get(&data, CSRFP_BUSY_KEY, r->pool);
+    return data && ((csrfp_busy_state *)data)->timedOut;
+}
+
+/*
+ * Function: csrfp_busy_report
+ * Child pool cleanup, logs store contention seen by the child
+ *
+ * Parameters: 
+ * data - server_rec object
+ *
+ * Returns: 
+ * apr_status_t
+ */
+static apr_status_t csrfp_busy_report(void *data)
+{
+    server_rec *s = data;
+
+    if (apr_atomic_read32(&storeBusyEvents)) {
+        ap_log_error(APLOG_MARK, APLOG_NOTICE, 0, s,
+                     "CSRFP token store was locked %u times, %u waits, %u timeouts",
+                     apr_atomic_read32(&storeBusyEvents),
+                     apr_atomic_read32(&storeBusyWaits),
+                     apr_atomic_read32(&storeBusyTimeouts));
+    }
+    return APR_SUCCESS;
+}
+
+/*
+ * Function: csrfp_sql_open
+ * Opens a connection to the store, creating tables if needed
+ *
+ * Parameters: 
+ * conf - csrfp_config object
+ * path - path of the db file, see <csrfp_store_shard>
+ * p - pool for temporary allocations
+ * error - set to error message on failure
+ *
+ * Returns: 
+ * db, SQLITE database object on success, NULL otherwise
+ */
+static sqlite3 *csrfp_sql_open(csrfp_config *conf, const char *path,
+                               apr_pool_t *p, const char **error)
+{
+    sqlite3 *db;
+
+    // Connection is only ever used by one thread at a time
+    int rc = sqlite3_open_v2(path, &db,
+                SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_NOMUTEX, NULL);
+    if (rc != SQLITE_OK) {
+        *error = apr_pstrcat(p, "open: ", sqlite3_errmsg(db), NULL);
+        sqlite3_close(db);
+        return NULL;
+    }
+
+    // Own budget for setting up, users of the connection set theirs
+    csrfp_busy_state busy;
+    csrfp_busy_start(&busy, conf);
+    sqlite3_busy_handler(db, csrfp_sql_busy, &busy);
+
+    // Connection settings of this server's store, sqlite defaults
+    // for those not configured. journal_mode is kept in the file
+    const char *pragmas = apr_pstrcat(p,
+        conf->storeJournalMode
+            ? apr_psprintf(p, "PRAGMA journal_mode = %s;", conf->storeJournalMode) : "",
+        conf->storeSynchronous
+            ? apr_psprintf(p, "PRAGMA synchronous = %s;", conf->storeSynchronous) : "",
+        conf->storeMmapSize != CSRFP_UNSET
+            ? apr_psprintf(p, "PRAGMA mmap_size = %" APR_INT64_T_FMT ";", conf->storeMmapSize) : "",
+        conf->storeCacheSize != CSRFP_UNSET
+            ? apr_psprintf(p, "PRAGMA cache_size = -%d;", conf->storeCacheSize) : "",
+        NULL);
+    char *pragmaErrMsg = NULL;
+    if (*pragmas && sqlite3_exec(db, pragmas, 0, 0, &pragmaErrMsg) != SQLITE_OK) {
+        *error = apr_pstrcat(p, "pragma: ", pragmaErrMsg, NULL);
+        sqlite3_free(pragmaErrMsg);
+        sqlite3_close(db);
+        return NULL;
     }
 
     //#todo: make sessid, token length configurable. also timestamp length
     // & compile this sql string based on those values here
-    const char* sql = apr_psprintf(r->pool, "CREATE TABLE IF NOT EXISTS CSRFP("  \
+    // ring - earlier tokens of the session, newest first, each
+    // token followed by its 10 digit issue time
+    const char* sql = apr_psprintf(p, "CREATE TABLE IF NOT EXISTS CSRFP("  \
          "sessid char(%d) PRIMARY KEY NOT NULL," \
          "token char(%d) NOT NULL,"\
-         "timestamp int NOT NULL );", 20, conf->tokenLength);
+         "timestamp int NOT NULL,"\
+         "ring text );", 20, conf->tokenLength);
+
+    // Error reporting 
+    char *zErrMsg = 0;
+
+    /* Execute SQL statement */
+    rc = sqlite3_exec(db, sql, 0, 0, &zErrMsg);
+    if( rc == SQLITE_OK ){
+        // Store created by an older version has no ring yet, fails
+        // harmlessly (duplicate column) otherwise
+        sqlite3_exec(db, "ALTER TABLE CSRFP ADD COLUMN ring text", 0, 0, NULL);
+        // Create a table for storing, the requests count
+        sql = "CREATE TABLE IF NOT EXISTS CSRFP_COUNTER (" \
+                "counter int NOT NULL );";
+        rc = sqlite3_exec(db, sql, 0, 0, &zErrMsg);
+    }
+    if( rc != SQLITE_OK ){
+        *error = apr_pstrcat(p, "exec: ", zErrMsg, NULL);
+        sqlite3_free(zErrMsg);
+        sqlite3_close(db);
+        return NULL;
+    }
+
+    sqlite3_busy_handler(db, NULL, NULL);
+    return db;
+}
+
+#if APR_HAS_THREADS
+/*
+ * Function: csrfp_sql_construct
+ * apr_reslist constructor, opens a pooled store connection
+ *
+ * Parameters: 
+ * resource - set to the sqlite3 object
+ * params - csrfp_store_shard object
+ * pool - reslist pool
+ *
+ * Returns:
+ * APR_SUCCESS, or APR_EGENERAL if store can't be opened
+ */
+static apr_status_t csrfp_sql_construct(void **resource, void *params, apr_pool_t *pool)
+{
+    csrfp_store_shard *shard = params;
+    csrfp_config *conf = ap_get_module_config(shard->server->module_config,
+                                                &csrf_protector_module);
+    const char *error = NULL;
+
+    *resource = csrfp_sql_open(conf, shard->path, pool, &error);
+    if (*resource == NULL) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, 0, shard->server,
+                     "CSRFP unable to open store %s, %s", shard->path, error);
+        return APR_EGENERAL;
+    }
+    return APR_SUCCESS;
+}
+
+/*
+ * Function: csrfp_sql_destruct
+ * apr_reslist destructor, closes a pooled store connection
+ *
+ * Parameters: 
+ * resource - sqlite3 object
+ * params - csrfp_store_shard object
+ * pool - reslist pool
+ *
+ * Returns:
+ * APR_SUCCESS
+ */
+static apr_status_t csrfp_sql_destruct(void *resource, void *params, apr_pool_t *pool)
+{
+    sqlite3_close((sqlite3 *)resource);
+    return APR_SUCCESS;
+}
+#endif
+
+/*
+ * Function: csrfp_store_shard_of
+ * Picks shard of the request's store a session is kept in, by hash of
+ * its id
+ *
+ * Parameters: 
+ * r - request_rec object
+ * sessid - session id
+ *
+ * Returns: 
+ * csrfp_store_shard object
+ */
+static csrfp_store_shard *csrfp_store_shard_of(request_rec *r, const char *sessid)
+{
+    csrfp_store *store = apr_hash_get(storeByServer, &r->server, sizeof(r->server));
+    if (store == NULL) {
+        store = mainStore;
+    }
+    if (store->shardCount <= 1) {
+        return store->shards;
+    }
+    // High bits, low ones pick the token cache bucket
+    return &store->shards[(csrfp_pair_hash(sessid, "") >> 32) % store->shardCount];
+}
+
+/*
+ * Function: csrfp_sql_init
+ * Function to get an exclusive connection to store shard of sessid
+ * for this request, hand it back with <csrfp_sql_release>. Statements
+ * on it wait on a locked store within the request's storeBusyTimeout
+ *
+ * Parameters: 
+ * r - request_rec object
+ * sessid - session id
+ *
+ * Returns: 
+ * db, SQLITE database object on success
+ */
+static sqlite3 *csrfp_sql_init(request_rec *r, const char *sessid)
+{
+    csrfp_config *conf = ap_get_module_config(r->server->module_config,
+                                                &csrf_protector_module);
+    csrfp_store_shard *shard = csrfp_store_shard_of(r, sessid);
+    const char *error = NULL;
+    sqlite3 *db;
 
-    // Error reporting 
-    char *zErrMsg = 0;
+#if APR_HAS_THREADS
+    if (shard->pool) {
+        void *resource = NULL;
+        if (apr_reslist_acquire(shard->pool, &resource) != APR_SUCCESS) {
+            #ifdef DEBUG
+                apr_table_add(r->headers_out, "sql-init-open-error",
+                              "unable to acquire pooled connection");
+            #endif
+            return NULL;
+        }
+        sqlite3_busy_handler(resource, csrfp_sql_busy, csrfp_busy_state_of(r));
+        return resource;
+    }
+#endif
 
-    /* Execute SQL statement */
-    rc = sqlite3_exec(db, sql, 0, 0, &zErrMsg);
-    if( rc != SQLITE_OK ){
+    db = csrfp_sql_open(conf, shard->path, r->pool, &error);
+    if (db == NULL) {
         #ifdef DEBUG
-            apr_table_addn(r->headers_out, "sql-init-exec-error", zErrMsg);
+            apr_table_add(r->headers_out, "sql-init-open-error", error);
         #endif
-        return NULL;
+    } else {
+        sqlite3_busy_handler(db, csrfp_sql_busy, csrfp_busy_state_of(r));
     }
+    return db;
+}
 
-    // Create a table for storing, the requests count
-    sql = apr_psprintf(r->pool, "CREATE TABLE IF NOT EXISTS CSRFP_COUNTER (" \
-            "counter int NOT NULL );");
+/*
+ * Function: csrfp_sql_release
+ * Hands back a connection got from <csrfp_sql_init>
+ *
+ * Parameters: 
+ * r - request_rec object
+ * sessid - session id it was got for
+ * db - sqlite3 object
+ *
+ * Returns: 
+ * void
+ */
+static void csrfp_sql_release(request_rec *r, const char *sessid, sqlite3 *db)
+{
+    // For LogFormat %{csrfp_store_waits}n
+    csrfp_busy_state *busy = csrfp_busy_state_of(r);
+    if (busy->waits) {
+        apr_table_setn(r->notes, CSRFP_STORE_WAITS_NOTE, apr_itoa(r->pool, busy->waits));
+    }
 
-    rc = sqlite3_exec(db, sql, 0, 0, &zErrMsg);
-    if( rc != SQLITE_OK ){
-        #ifdef DEBUG
-            apr_table_addn(r->headers_out, "sql-init-counter-error", zErrMsg);
-        #endif
-        return NULL;
-    }    
+#if APR_HAS_THREADS
+    csrfp_store_shard *shard = csrfp_store_shard_of(r, sessid);
+    if (shard->pool) {
+        // Budget lives in r->pool
+        sqlite3_busy_handler(db, NULL, NULL);
+        apr_reslist_release(shard->pool, db);
+        return;
+    }
+#endif
+    sqlite3_close(db);
+}
 
-    return db;
+/*
+ * Function: csrfp_store_attach
+ * Sets up token store of a server in this child, reusing the one of an
+ * earlier server with same storeDirectory & storeShards
+ *
+ * Parameters: 
+ * p - child pool
+ * s - server_rec object
+ *
+ * Returns: 
+ * csrfp_store object
+ */
+static csrfp_store *csrfp_store_attach(apr_pool_t *p, server_rec *s)
+{
+    csrfp_config *conf = ap_get_module_config(s->module_config,
+                                                &csrf_protector_module);
+    csrfp_store *store;
+    int shard;
+
+    for (store = storeList; store; store = store->next) {
+        if (store->shardCount == conf->storeShards
+            && !strcmp(store->directory, conf->storeDirectory)) {
+            return store;
+        }
+    }
+
+    store = apr_pcalloc(p, sizeof(csrfp_store));
+    store->directory = conf->storeDirectory;
+    store->shardCount = conf->storeShards;
+    store->shards = apr_pcalloc(p, sizeof(csrfp_store_shard) * store->shardCount);
+    store->next = storeList;
+    storeList = store;
+
+#if APR_HAS_THREADS
+    // Connections, at most one per worker thread & shard, opened lazily
+    int threads = 1;
+    ap_mpm_query(AP_MPMQ_MAX_THREADS, &threads);
+    if (threads < 1) threads = 1;
+#endif
+
+    // A single shard keeps the original file name
+    for (shard = 0; shard < store->shardCount; shard++) {
+        csrfp_store_shard *sh = &store->shards[shard];
+        sh->server = s;
+        sh->path = (store->shardCount == 1)
+            ? apr_pstrcat(p, store->directory, "/" CSRFP_STORE_FILE ".db", NULL)
+            : apr_psprintf(p, "%s/" CSRFP_STORE_FILE "-%d.db", store->directory, shard);
+#if APR_HAS_THREADS
+        // Idle connections are kept (smax = hmax, no ttl), reopening
+        // one reruns table setup & pragmas
+        if (apr_reslist_create(&sh->pool, 0, threads, threads, 0,
+                               csrfp_sql_construct, csrfp_sql_destruct,
+                               sh, p) != APR_SUCCESS) {
+            // Fall back to a connection per request
+            sh->pool = NULL;
+            ap_log_error(APLOG_MARK, APLOG_WARNING, 0, s,
+                         "CSRFP unable to create connection pool for %s", sh->path);
+        }
+#endif
+    }
+    return store;
 }
 
 /*
@@ -859,99 +3159,146 @@ static int csrfp_sql_addn(request_rec *r, sqlite3 *db, const char *sessid, const
         return -1;
 
     int timestamp = (unsigned)time(NULL);
-    
-    // Check if session id exists in db
-    int shouldUpdate = 0;
     sqlite3_stmt *res;
     const char *tail;
 
-    // #todo: you might want to create a seperate pool for this & destroy it later
-    const char *sql = apr_psprintf(r->pool, "SELECT sessid FROM CSRFP WHERE sessid = '%s'", sessid);
-    int rc = sqlite3_prepare_v2(db, sql, 1000, &res, &tail);
+    csrfp_config *conf = ap_get_module_config(r->server->module_config,
+                                                &csrf_protector_module);
+
+    // sessid is PRIMARY KEY, so insert or update in one statement
+    // values are bound, never interpolated into sql
+    int rc = sqlite3_prepare_v2(db, CSRFP_SQL_ADDN, -1, &res, &tail);
     if (rc != SQLITE_OK) {
         #ifdef DEBUG
-            apr_table_addn(r->headers_out, "sql-addn-select-error", tail);
+            apr_table_add(r->headers_out, "sql-addn-prepare-error", sqlite3_errmsg(db));
         #endif
         return rc;
-    } else {
-        while (sqlite3_step(res) == SQLITE_ROW) {
-            ++shouldUpdate;
-            break;
-        }
     }
-    sqlite3_reset(res);
 
-    char *zErrMsg = NULL;
-    if (shouldUpdate == 0) {
-        // Insert
-        const char *sql_ = apr_psprintf(r->pool, "INSERT INTO CSRFP (sessid, token, timestamp) VALUES ('%s', '%s', %d)", sessid, value, timestamp);
-        rc = sqlite3_exec(db, sql_, 0, 0, &zErrMsg);
-        if (rc != SQLITE_OK) {
-            #ifdef DEBUG
-                apr_table_addn(r->headers_out, "sql-addn-insert-error", zErrMsg);
-            #endif
-            return rc;
-        }
-    } else {
-        // Update
-        const char *sql_ = apr_psprintf(r->pool, "UPDATE CSRFP SET token = '%s', timestamp = %d WHERE sessid = '%s'", value, timestamp, sessid);
-        rc = sqlite3_exec(db, sql_, 0, 0, &zErrMsg);
-        if (rc != SQLITE_OK) {
-            #ifdef DEBUG
-                apr_table_addn(r->headers_out, "sql-addn-update-error", zErrMsg);
-            #endif
-            return rc;
-        }
+    sqlite3_bind_text(res, 1, sessid, -1, SQLITE_STATIC);
+    sqlite3_bind_text(res, 2, value, -1, SQLITE_STATIC);
+    sqlite3_bind_int(res, 3, timestamp);
+    sqlite3_bind_int(res, 4, (conf->tokenWindow - 1)
+                        * (conf->tokenLength + CSRFP_RING_STAMP_LENGTH));
+
+    rc = sqlite3_step(res);
+    sqlite3_finalize(res);
+    if (rc != SQLITE_DONE) {
+        #ifdef DEBUG
+            apr_table_add(r->headers_out, "sql-addn-error", sqlite3_errmsg(db));
+        #endif
+        return rc;
     }
 
     return SQLITE_OK;
 }
 
+/*
+ * Function: csrfp_ring_match
+ * Function to match value with tokens of a ring, every slot is
+ * compared so that time taken doesn't tell which one matched
+ *
+ * Parameters: 
+ * r - request_rec object
+ * ring - ring column of the session
+ * value - value to match
+ * oldest - tokens issued before this (unix time) have expired
+ *
+ * Returns: 
+ * 1 if an unexpired token of the ring matches, 0 otherwise
+ */
+static int csrfp_ring_match(request_rec *r, const char *ring, const char *value, int oldest)
+{
+    csrfp_config *conf = ap_get_module_config(r->server->module_config,
+                                                &csrf_protector_module);
+    apr_size_t slot = conf->tokenLength + CSRFP_RING_STAMP_LENGTH;
+    apr_size_t len = strlen(ring), off;
+    int hit = 0, n = 0;
+
+    for (off = 0; off + slot <= len && n < conf->tokenWindow - 1; off += slot, n++) {
+        char *token = apr_pstrndup(r->pool, ring + off, conf->tokenLength);
+        char *stamp = apr_pstrndup(r->pool, ring + off + conf->tokenLength,
+                                   CSRFP_RING_STAMP_LENGTH);
+        hit |= csrfp_token_equals(token, value) & (atoi(stamp) >= oldest);
+    }
+    return hit;
+}
+
 /*
  * Funciton: csrfp_sql_match
  * Function to match value in db to value sent as param
+ * Record is fetched by sessid alone (indexed point read, expired
+ * ones excluded) and token is compared in memory, in constant time,
+ * with the latest token and unexpired ones of the ring.
+ * Latest token is cached for later requests of the session
  *
  * Parameters: 
  * r - request_rec object
  * db - sqlite database object
  * sessid - session id for this user
  * value - value to match
+ * issued - set to time token was issued (unix time), 0 if it isn't the
+ *          latest one, may be NULL
  *
  * Returns: 
- * 0 for correct match
+ * 0 for correct match, 1 for no match, -1 if store couldn't be read
+ * (e.g. still locked when storeBusyTimeout ran out)
  */
-static int csrfp_sql_match(request_rec *r, sqlite3 *db, const char *sessid, const char *value)
+static int csrfp_sql_match(request_rec *r, sqlite3 *db, const char *sessid, const char *value,
+                            int *issued)
 {
     // sessid of value cannot be null
     if (sessid == NULL || value == NULL)
         return -1;
 
     int timestamp = (unsigned)time(NULL);
-    
-    // Check if session id exists in db
     sqlite3_stmt *res;
     const char *tail;
 
-    // #todo: you might want to create a seperate pool for this & destroy it later
-    char *sql = apr_psprintf(r->pool, "SELECT timestamp FROM CSRFP WHERE sessid = '%s' AND token = '%s'", sessid, value);
-    int rc = sqlite3_prepare_v2(db, sql,1000, &res, &tail);
+    int rc = sqlite3_prepare_v2(db, "SELECT token, timestamp, ring FROM CSRFP WHERE sessid = ? AND timestamp >= ?",
+                                -1, &res, &tail);
+    if (rc != SQLITE_OK) {
+        #ifdef DEBUG
+            apr_table_add(r->headers_out, "sql-match-select-error", sqlite3_errmsg(db));
+        #endif
+        return -1;
+    }
+
+    sqlite3_bind_text(res, 1, sessid, -1, SQLITE_STATIC);
+    sqlite3_bind_int(res, 2, timestamp - TOKEN_EXPIRY_MAXTIME);
 
-     if (rc != SQLITE_OK) {
+    rc = 1;     // no (unexpired) token for this session
+    int step = sqlite3_step(res);
+    if (step != SQLITE_ROW && step != SQLITE_DONE) {
         #ifdef DEBUG
-            apr_table_addn(r->headers_out, "sql-match-select-error", tail);
+            apr_table_add(r->headers_out, "sql-match-step-error", sqlite3_errmsg(db));
         #endif
-        return rc;
-    } else {
-        while (sqlite3_step(res) == SQLITE_ROW) {
-            if (timestamp > (atoi(sqlite3_column_text(res, 0)) + TOKEN_EXPIRY_MAXTIME)) {
-                sqlite3_reset(res);
-                return -1;
+        rc = -1;
+    } else if (step == SQLITE_ROW) {
+        const char *token = (const char *)sqlite3_column_text(res, 0);
+        if (token) {
+            csrfp_tokencache_put(sessid, token,
+                apr_time_from_sec(sqlite3_column_int(res, 1)));
+            if (csrfp_token_equals(token, value)) {
+                if (issued) {
+                    *issued = sqlite3_column_int(res, 1);
+                }
+                rc = 0;
             }
-            sqlite3_reset(res);
-            return 0;
         }
-        return 1;
-    }   
+
+        // Earlier tokens, e.g. of a page open in another tab
+        const char *ring = (const char *)sqlite3_column_text(res, 2);
+        if (rc && ring && csrfp_ring_match(r, ring, value,
+                                timestamp - TOKEN_EXPIRY_MAXTIME)) {
+            if (issued) {
+                *issued = 0;
+            }
+            rc = 0;
+        }
+    }
+    sqlite3_finalize(res);
+    return rc;
 }
 
 /*
@@ -978,6 +3325,330 @@ static void csrfp_sql_table_clean(request_rec *r, sqlite3 *db)
         #endif
     }
 }
+//=============================================================
+// Write behind of token issuance
+//=============================================================
+
+/*
+ * Function: csrfp_batch_push
+ * Queues issuance of a token for the batch writer. Entry stays visible
+ * to <csrfp_batch_match> till it is committed
+ *
+ * Parameters: 
+ * r - request_rec object
+ * sessid - session id for this user
+ * value - value of the token
+ *
+ * Returns: 
+ * 1 if queued, 0 if writer is not running or queue is full
+ */
+static int csrfp_batch_push(request_rec *r, const char *sessid, const char *value)
+{
+    int queued = 0;
+#if APR_HAS_THREADS
+    csrfp_config *conf = ap_get_module_config(r->server->module_config,
+                                                &csrf_protector_module);
+
+    if (batchThread == NULL || strlen(value) >= CSRFP_TOKEN_CACHE_MAXLENGTH) {
+        return 0;
+    }
+
+    apr_thread_mutex_lock(batchMutex);
+    if (batchTail - batchHead < batchCapacity) {
+        csrfp_pending_issue *e = &batchQueue[batchTail % batchCapacity];
+        apr_cpystrn(e->sessid, sessid, sizeof(e->sessid));
+        apr_cpystrn(e->token, value, sizeof(e->token));
+        e->timestamp = (unsigned)time(NULL);
+        e->ringLength = (conf->tokenWindow - 1)
+                        * (conf->tokenLength + CSRFP_RING_STAMP_LENGTH);
+        e->window = conf->tokenWindow;
+        e->shard = csrfp_store_shard_of(r, sessid);
+        e->done = 0;
+        ++batchTail;
+        queued = 1;
+        if (batchTail - batchHead >= batchSize) {
+            // Size threshold reached, don't wait for the timer
+            apr_thread_cond_signal(batchCond);
+        }
+    }
+    apr_thread_mutex_unlock(batchMutex);
+#endif
+    return queued;
+}
+
+/*
+ * Function: csrfp_batch_count
+ * Counts an issuance, for reseeding, when store isn't written inline
+ *
+ * Parameters: 
+ * void
+ *
+ * Returns: 
+ * integer, issuances of this child since last reseed
+ */
+static int csrfp_batch_count(void)
+{
+    int counter = 0;
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(batchMutex);
+    counter = ++batchIssued;
+    if (batchIssued >= RESEED_RAND_AT) {
+        batchIssued = 0;
+    }
+    apr_thread_mutex_unlock(batchMutex);
+#endif
+    return counter;
+}
+
+/*
+ * Function: csrfp_batch_match
+ * Overlay of not yet committed issuances, matches value with the
+ * newest tokenWindow tokens queued for sessid, older ones are
+ * superseded already
+ *
+ * Parameters: 
+ * sessid - session id for this user
+ * value - value to match
+ * issued - set to time token was issued (unix time), may be NULL
+ *
+ * Returns: 
+ * 1 if value is a queued token of sessid, 0 otherwise
+ */
+static int csrfp_batch_match(const char *sessid, const char *value, int *issued)
+{
+    int hit = 0;
+#if APR_HAS_THREADS
+    unsigned int i;
+
+    if (batchQueue == NULL) {
+        return 0;
+    }
+
+    int seen = 0;
+    apr_thread_mutex_lock(batchMutex);
+    for (i = batchTail; i != batchHead; i--) {
+        csrfp_pending_issue *e = &batchQueue[(i - 1) % batchCapacity];
+        if (strcmp(e->sessid, sessid)) {
+            continue;
+        }
+        if (++seen > e->window) {
+            break;
+        }
+        if (csrfp_token_equals(e->token, value)) {
+            if (issued) {
+                *issued = e->timestamp;
+            }
+            hit = 1;
+            break;
+        }
+    }
+    apr_thread_mutex_unlock(batchMutex);
+#endif
+    return hit;
+}
+
+#if APR_HAS_THREADS
+/*
+ * Function: csrfp_batch_commit_shard
+ * Writes queued issuances of one store shard in one transaction,
+ * expired tokens of the shard are cleaned in the same transaction
+ *
+ * Parameters: 
+ * shard - csrfp_store_shard object
+ * head, tail - queued entries to look at, [head, tail)
+ *
+ * Returns: 
+ * SQLITE_OK if committed (or nothing to commit), error code otherwise
+ */
+static int csrfp_batch_commit_shard(csrfp_store_shard *shard,
+                                    unsigned int head, unsigned int tail)
+{
+    sqlite3_stmt *res = NULL;
+    sqlite3 *db;
+    unsigned int i;
+    int pending = 0;
+    int rc;
+
+    for (i = head; i != tail; i++) {
+        csrfp_pending_issue *e = &batchQueue[i % batchCapacity];
+        pending += (e->shard == shard && !e->done);
+    }
+    if (!pending) {
+        return SQLITE_OK;
+    }
+
+    csrfp_config *conf = ap_get_module_config(shard->server->module_config,
+                                                &csrf_protector_module);
+    if (shard->writer == NULL) {
+        const char *error = NULL;
+        shard->writer = csrfp_sql_open(conf, shard->path, batchPool, &error);
+        if (shard->writer == NULL) {
+            ap_log_error(APLOG_MARK, APLOG_WARNING, 0, shard->server,
+                         "CSRFP batch writer unable to open store %s, %s",
+                         shard->path, error);
+            return SQLITE_CANTOPEN;
+        }
+    }
+    db = shard->writer;
+
+    // Fresh budget per transaction, failed ones are retried next round
+    csrfp_busy_start(&batchBusy, conf);
+    sqlite3_busy_handler(db, csrfp_sql_busy, &batchBusy);
+
+    rc = sqlite3_exec(db, "BEGIN IMMEDIATE", 0, 0, NULL);
+    if (rc == SQLITE_OK) {
+        rc = sqlite3_prepare_v2(db, CSRFP_SQL_ADDN, -1, &res, NULL);
+    }
+    for (i = head; rc == SQLITE_OK && i != tail; i++) {
+        csrfp_pending_issue *e = &batchQueue[i % batchCapacity];
+        if (e->shard != shard || e->done) {
+            continue;
+        }
+        sqlite3_bind_text(res, 1, e->sessid, -1, SQLITE_STATIC);
+        sqlite3_bind_text(res, 2, e->token, -1, SQLITE_STATIC);
+        sqlite3_bind_int(res, 3, e->timestamp);
+        sqlite3_bind_int(res, 4, e->ringLength);
+        rc = (sqlite3_step(res) == SQLITE_DONE) ? SQLITE_OK : SQLITE_ERROR;
+        sqlite3_reset(res);
+    }
+    sqlite3_finalize(res);
+
+    if (rc == SQLITE_OK) {
+        char *sql = sqlite3_mprintf("DELETE FROM CSRFP WHERE timestamp < %d",
+                                (int)((unsigned)time(NULL) - TOKEN_EXPIRY_MAXTIME));
+        sqlite3_exec(db, sql, 0, 0, NULL);
+        sqlite3_free(sql);
+        rc = sqlite3_exec(db, "COMMIT", 0, 0, NULL);
+    }
+    if (rc != SQLITE_OK) {
+        // Kept queued, retried with the next batch
+        sqlite3_exec(db, "ROLLBACK", 0, 0, NULL);
+        ap_log_error(APLOG_MARK, APLOG_WARNING, 0, shard->server,
+                     "CSRFP unable to commit %d queued tokens to %s, %s",
+                     pending, shard->path, sqlite3_errmsg(db));
+        return rc;
+    }
+
+    // Only the writer looks at done, no need to lock
+    for (i = head; i != tail; i++) {
+        csrfp_pending_issue *e = &batchQueue[i % batchCapacity];
+        if (e->shard == shard) {
+            e->done = 1;
+        }
+    }
+    return SQLITE_OK;
+}
+
+/*
+ * Function: csrfp_batch_commit
+ * Writes queued issuances, a transaction per store shard. Entries are
+ * dequeued only once committed, so they stay visible to validation
+ * meanwhile
+ *
+ * Parameters: 
+ * void
+ *
+ * Returns: 
+ * void
+ */
+static void csrfp_batch_commit(void)
+{
+    unsigned int head, tail, i;
+
+    // Producers only append, entries in [head, tail) stay put
+    apr_thread_mutex_lock(batchMutex);
+    head = batchHead;
+    tail = batchTail;
+    apr_thread_mutex_unlock(batchMutex);
+
+    if (head == tail) {
+        return;
+    }
+
+    // Each shard with queued entries once per round
+    ++batchRound;
+    for (i = head; i != tail; i++) {
+        csrfp_pending_issue *e = &batchQueue[i % batchCapacity];
+        if (!e->done && e->shard->round != batchRound) {
+            e->shard->round = batchRound;
+            csrfp_batch_commit_shard(e->shard, head, tail);
+        }
+    }
+
+    // Dequeue up to the first entry of a shard that failed
+    apr_thread_mutex_lock(batchMutex);
+    while (batchHead != tail && batchQueue[batchHead % batchCapacity].done) {
+        ++batchHead;
+    }
+    apr_thread_mutex_unlock(batchMutex);
+}
+
+/*
+ * Function: csrfp_batch_writer
+ * Batch writer thread, commits queued issuances every storeBatchInterval
+ * or as soon as storeBatchSize of them are queued
+ *
+ * Parameters: 
+ * thd - this thread
+ * data - unused
+ *
+ * Returns: 
+ * NULL
+ */
+static void * APR_THREAD_FUNC csrfp_batch_writer(apr_thread_t *thd, void *data)
+{
+    int stop = 0;
+
+    while (!stop) {
+        apr_thread_mutex_lock(batchMutex);
+        if (!batchStop && batchTail - batchHead < batchSize) {
+            apr_thread_cond_timedwait(batchCond, batchMutex, batchInterval);
+        }
+        stop = batchStop;
+        apr_thread_mutex_unlock(batchMutex);
+
+        csrfp_batch_commit();
+    }
+
+    apr_thread_exit(thd, APR_SUCCESS);
+    return NULL;
+}
+
+/*
+ * Function: csrfp_batch_stop
+ * Child pool cleanup, stops batch writer once queued issuances are
+ * committed
+ *
+ * Parameters: 
+ * data - unused
+ *
+ * Returns: 
+ * apr_status_t
+ */
+static apr_status_t csrfp_batch_stop(void *data)
+{
+    apr_status_t rv;
+    apr_thread_t *thd = batchThread;
+    csrfp_store *store;
+    int i;
+
+    apr_thread_mutex_lock(batchMutex);
+    batchStop = 1;
+    apr_thread_cond_signal(batchCond);
+    apr_thread_mutex_unlock(batchMutex);
+
+    apr_thread_join(&rv, thd);
+    batchThread = NULL;
+    for (store = storeList; store; store = store->next) {
+        for (i = 0; i < store->shardCount; i++) {
+            sqlite3_close(store->shards[i].writer);
+            store->shards[i].writer = NULL;
+        }
+    }
+    return APR_SUCCESS;
+}
+#endif
+
 //=====================================================================
 // Handlers -- call back functions for different hooks
 //=====================================================================
@@ -995,60 +3666,105 @@ static int csrfp_header_parser(request_rec *r)
 {
     csrfp_config *conf = ap_get_module_config(r->server->module_config,
                                                 &csrf_protector_module);
-    if (conf->flag == CSRFP_FALSE) 
+    const csrfp_policy *policy = csrfp_get_policy(r);
+    if (policy->flag == CSRFP_FALSE) 
         return OK;
 
-    if (!needvalidation(r)) {
-        // No need of validation, go ahead!
+    if (r->main) {
+        // Subrequests (SSI includes etc.) are left to the main request
         return OK;
     }
 
-    // Start the sql connection
-    sqlite3 *db = csrfp_sql_init(r);
-    if (db == NULL) {
-        ap_log_rerror(APLOG_MARK, APLOG_NOERRNO|APLOG_ERR, 0, r,
-                      "CSRFP UNABLE TO ACCESS DB OBJECT");
-        // #todo: ask Kevin/Abbas about this once
-        ap_rprintf(r, "OWASP CSRF Protector - SQLITE3 Database Open Error");
-        return DONE;
+    if (r->prev && apr_table_get(r->subprocess_env, "REDIRECT_" CSRFP_VALIDATED_ENV)) {
+        // Internal redirect of a request that passed validation, carry
+        // its decision over, renamed to REDIRECT_* by apache. Others
+        // (excluded or unprotected original URI, ErrorDocument...) are
+        // checked like any request
+        const char *regenToken = apr_table_get(r->subprocess_env,
+                                    "REDIRECT_regen_csrfptoken");
+        apr_table_set(r->subprocess_env, CSRFP_VALIDATED_ENV, "1");
+        if (regenToken) {
+            apr_table_set(r->subprocess_env, "regen_csrfptoken", regenToken);
+        }
+        apr_table_set(r->subprocess_env, "mod_csrfp_enabled", "true");
+        apr_table_setn(r->headers_out, "X-Protected-By", CSRFP_NAME_VERSION);
+        return OK;
+    }
+
+    if (!needvalidation(r)) {
+        // No need of validation, go ahead!
+        return OK;
     }
 
+    // Classify the request first, store is opened only if
+    // a token actually has to be validated
     // If request type is POST
     // Need to check configs weather or not a validation is needed POST
-    if ( !strcmp(r->method, "POST")
-        && !validateToken(r, db)) {
-            
-        // Log this -- [x]
-        // Take actions as per configuration
-
-        return failedValidationAction(r);
-    } else if ( !strcmp(r->method, "GET") ) {
-
-        
+    int shouldValidate = !strcmp(r->method, "POST");
+    if ( !strcmp(r->method, "GET") ) {
+        const char *currentUrl = apr_pstrcat(r->pool, "http://", getCurrentUrl(r), NULL);
+        const char *currentUrlSecure = apr_pstrcat(r->pool, "https://", getCurrentUrl(r), NULL);
 
-        struct getRuleNode *p = getTop;
+        struct getRuleNode *p = policy->getRules;
         while (p != NULL) {
-            const char *currentUrl = apr_pstrcat(r->pool, "http://", getCurrentUrl(r), NULL);
-            const char *currentUrlSecure = apr_pstrcat(r->pool, "https://", getCurrentUrl(r), NULL);
-
             if (ap_regexec(p->pattern, currentUrl, 0, NULL, 0) == 0
                 || ap_regexec(p->pattern, currentUrlSecure, 0, NULL, 0) == 0) {
-                if (!validateToken(r, db)) {
-
-                    // Means pattern matched && validation failed
-                    // Log this -- [x]
-                    // Take actions as per configuration
-                    // Close the sql connection
-                    sqlite3_close(db);
-                    return failedValidationAction(r);
-                }
+                ++shouldValidate;
+                break;
             }
             p = p->next;
         }
     }
-    
-    // Close the sql connection
-    sqlite3_close(db);
+
+    if (shouldValidate && csrfp_throttle(r, 0)) {
+        // Client failed too often recently
+        return throttledAction(r);
+    }
+
+    // Request was checked, by origin or token, if it gets past below
+    int checked = shouldValidate;
+
+    if (shouldValidate && conf->originCheck != origin_check_off) {
+        // Header compare only, obvious cases never reach the store
+        Request_Origin origin = getRequestOrigin(r);
+        if (origin == origin_cross) {
+            return failedValidationAction(r);
+        } else if (origin == origin_same
+            && conf->originCheck == origin_check_trust) {
+            shouldValidate = 0;
+        }
+    }
+
+    if (shouldValidate) {
+        int isValid = validateToken(r);
+        if (isValid < 0 && csrfp_busy_timed_out(r)) {
+            // Contention, not a broken store, client may just retry
+            ap_log_rerror(APLOG_MARK, APLOG_NOERRNO|APLOG_WARNING, 0, r,
+                          "CSRFP token store locked, storeBusyTimeout ran out");
+            apr_table_setn(r->err_headers_out, "Retry-After", CSRFP_STORE_RETRY_AFTER);
+            return HTTP_SERVICE_UNAVAILABLE;
+        }
+        if (isValid < 0) {
+            ap_log_rerror(APLOG_MARK, APLOG_NOERRNO|APLOG_ERR, 0, r,
+                          "CSRFP UNABLE TO ACCESS DB OBJECT");
+            // #todo: ask Kevin/Abbas about this once
+            ap_rprintf(r, "OWASP CSRF Protector - SQLITE3 Database Open Error");
+            return DONE;
+        }
+
+        if (!isValid) {
+            // Means POST or pattern matched GET && validation failed
+            // Log this -- [x]
+            // Take actions as per configuration
+            return failedValidationAction(r);
+        }
+    }
+
+    // Passed validation, internal redirects of it are let through on
+    // this. Those of unchecked requests are checked for their own URI
+    if (checked) {
+        apr_table_set(r->subprocess_env, CSRFP_VALIDATED_ENV, "1");
+    }
 
     // Information for output_filter to regenrate token and
     // append it to output header -- Regenrate token
@@ -1064,6 +3780,73 @@ static int csrfp_header_parser(request_rec *r)
     return OK;
 }
 
+/*
+ * Function: csrfp_post_read_request
+ * Runs validation right after request headers are read, if
+ * validationPhase is post_read_request
+ *
+ * Parameters:
+ * r - request_rec object
+ *
+ * Return:
+ * status code, int
+ */
+static int csrfp_post_read_request(request_rec *r)
+{
+    csrfp_config *conf = ap_get_module_config(r->server->module_config,
+                                                &csrf_protector_module);
+    if (conf->validationPhase != phase_post_read_request)
+        return DECLINED;
+    apr_table_setn(r->notes, CSRFP_CHECKED_NOTE, "1");
+    return csrfp_header_parser(r);
+}
+
+/*
+ * Function: csrfp_early_header_parser
+ * Runs validation in header parser phase, i.e. before
+ * authentication/authorization, if validationPhase is header_parser
+ *
+ * Parameters:
+ * r - request_rec object
+ *
+ * Return:
+ * status code, int
+ */
+static int csrfp_early_header_parser(request_rec *r)
+{
+    csrfp_config *conf = ap_get_module_config(r->server->module_config,
+                                                &csrf_protector_module);
+    if (conf->validationPhase == phase_post_read_request
+        && r->prev && !apr_table_get(r->notes, CSRFP_CHECKED_NOTE)) {
+        // Internal redirect that post_read_request didn't run for,
+        // decision of the original request is carried over (or the
+        // redirect checked) here, so its response still gets a token
+        return csrfp_header_parser(r);
+    }
+    if (conf->validationPhase != phase_header_parser)
+        return DECLINED;
+    return csrfp_header_parser(r);
+}
+
+/*
+ * Function: csrfp_fixups
+ * Runs validation in fixups phase (default)
+ *
+ * Parameters:
+ * r - request_rec object
+ *
+ * Return:
+ * status code, int
+ */
+static int csrfp_fixups(request_rec *r)
+{
+    csrfp_config *conf = ap_get_module_config(r->server->module_config,
+                                                &csrf_protector_module);
+    if (conf->validationPhase != phase_fixups)
+        return DECLINED;
+    return csrfp_header_parser(r);
+}
+
 /*
  * Function: csrfp_out_filter
  * Filters output generated by content generator and modify content
@@ -1083,87 +3866,82 @@ static apr_status_t csrfp_out_filter(ap_filter_t *f, apr_bucket_brigade *bb)
      * if request  file is image or js, ignore the filter on the top itself
      */
     if (!needvalidation(r)) {
-        // No need of validation, go ahead!
+        // No need of validation, go ahead! but CSRFP_INJECT_HEADER
+        // is internal to server, so don't leak it to client
+        apr_table_unset(r->headers_out, CSRFP_INJECT_HEADER);
+        apr_table_unset(r->err_headers_out, CSRFP_INJECT_HEADER);
         ap_remove_output_filter(f);
         return ap_pass_brigade(f->next, bb);
     }
 
+    csrfp_config *conf = ap_get_module_config(r->server->module_config,
+                                                &csrf_protector_module);
+
     // Get the context config
     csrfp_opf_ctx *rctx = csrfp_get_rctx(r);
 
     /*
-     * - Determine if it's html and force chunked response
+     * - Determine if it's html and spool it or force chunked response
      * - search <body to insert <noscript> .. </noscript> info
      * - search </body> to insert script
      * - set csrfp_token cookie
      * - end (all done)
      */
-    if(rctx->state == op_init) {
+    if(rctx->state == op_init
+        && rctx->clstate == nmodified) {
+        Inject_Policy policy = getInjectPolicy(r);
+        if (policy == inject_off) {
+            // Backend opted out, neither scan the response nor regenerate token
+            rctx->state = op_end;
+            rctx->search = NULL;
+            rctx->tokenIssued = CSRFP_TRUE;
+            ap_remove_output_filter(f);
+            return ap_pass_brigade(f->next, bb);
+        }
+
         const char *type = getOutputContentType(r);
-        if(type == NULL || ( strncasecmp(type, "text/html", 9) != 0
-            && strncasecmp(type, "text/xhtml", 10) != 0) ) {
+        if (isBodilessResponse(r)) {
+            // Nothing to scan, Content-Length stays as is, and
+            // token is not regenerated unless configured otherwise
+            rctx->state = op_end;
+            rctx->search = NULL;
+            if (conf->regenForBodiless == CSRFP_FALSE) {
+                rctx->tokenIssued = CSRFP_TRUE;
+            }
+        } else if (apr_table_get(r->headers_in, "Range")) {
+            // byterange filter runs after us and may still make it a 206,
+            // whose ranges must match the unmodified body, so don't scan.
+            // Could as well be a full 200 though, token is still issued
+            rctx->state = op_end;
+            rctx->search = NULL;
+        } else if(policy != inject_on && (type == NULL
+            || ( strncasecmp(type, "text/html", 9) != 0
+            && strncasecmp(type, "text/xhtml", 10) != 0)) ) {
             // we don't want to parse this response (no html)
             rctx->state = op_end;
             rctx->search = NULL;
-            ap_remove_output_filter(f);
         } else {
             // start searching head/body to inject our script
 
-            // -- need to modify the Content-Length header
-            if(CSRFP_CHUNKED_ONLY) {
-                // send as chunked response
-                apr_table_unset(r->headers_out, "Content-Length");
-                apr_table_unset(r->err_headers_out, "Content-Length");
-                r->chunked = 1;
-                rctx->clstate = modified;  // Content-Length need not be modified anymore
-            } else {
-                // Modify the content-length header -- if available
-                /**
-                 * #todo: probably Content-Length is not generated by the time this hook is called
-                 *          So we might want this be done by later hook
-                 *          Calculate the content-length value?
-                 */
-                int errh = 0;
-                const char* cl =  apr_table_get(r->headers_out, "Content-Length");
-                if(!cl) {
-                    errh = 1;
-                    cl =  apr_table_get(r->err_headers_out, "Content-Length");
-                }
-
-                if(cl) {
-                    // adjust non-chunked response
-                    char *length;
-                    apr_off_t s;
-                    char *errp = NULL;
-                    if(apr_strtoff(&s, cl, &errp, 10) == APR_SUCCESS) {
-                        s = s + strlen(rctx->script) + strlen(rctx->noscript);
-                        length = apr_psprintf(r->pool, "%"APR_OFF_T_FMT, s);
-                        if(!errh) {
-                            apr_table_set(r->headers_out, "Content-Length", length);
-                        } else {
-                            apr_table_set(r->err_headers_out, "Content-Length", length);
-                        }
-                    } else {
-                        // fallback to chunked
-                        r->chunked = 1;
-                        if(!errh) {
-                            apr_table_unset(r->headers_out, "Content-Length");
-                        } else {
-                            apr_table_unset(r->err_headers_out, "Content-Length");
-                        }
-                    }
+            // -- Content-Length of the generator can no longer be trusted
+            // it's either recalculated once whole response is spooled or
+            // dropped, in which case core falls back to chunked response
+            apr_table_unset(r->headers_out, "Content-Length");
+            apr_table_unset(r->err_headers_out, "Content-Length");
+            rctx->clstate = modified;  // Content-Length need not be modified anymore
 
-                    rctx->clstate = modified;  // Content-Length need not be modified anymore
-                } else {
-                    // This means Content-Length header has not yet been generated
-                    // #todo need to do something about this
-                }
+            if (!CSRFP_CHUNKED_ONLY && conf->spoolSize > 0) {
+                rctx->spool = apr_brigade_create(r->pool, f->c->bucket_alloc);
+                rctx->spooling = CSRFP_TRUE;
             }
         }
     }
 
     // start searching within this brigade...
-    if (rctx->search) {
+    if (rctx->search && conf->injectionMarker) {
+        // application told us where to inject, no need of <body, </body> hunt
+        csrfp_inject_at_marker(f, bb, rctx, conf->injectionMarker);
+    } else if (rctx->search) {
         apr_bucket *b;
 
         // Create custo pool for Output Filter
@@ -1171,12 +3949,6 @@ static apr_status_t csrfp_out_filter(ap_filter_t *f, apr_bucket_brigade *bb)
         apr_pool_create(&pool, r->pool);
 
         for (b = APR_BRIGADE_FIRST(bb); b != APR_BRIGADE_SENTINEL(bb); b = APR_BUCKET_NEXT(b)) {
-            if (APR_BUCKET_IS_EOS(b)) {
-                /* If we ever see an EOS, make sure to FLUSH. */
-                apr_bucket *flush = apr_bucket_flush_create(f->c->bucket_alloc);
-                APR_BUCKET_INSERT_BEFORE(b, flush);
-            }
-
             if (!(APR_BUCKET_IS_METADATA(b))) {
                 const char *buf;
                 apr_size_t nbytes;
@@ -1191,7 +3963,7 @@ static apr_status_t csrfp_out_filter(ap_filter_t *f, apr_bucket_brigade *bb)
                  *  4. '<body' not found, no overlap issue
                  */
                 restart:
-                if (apr_bucket_read(b, &buf, &nbytes, APR_BLOCK_READ) == APR_SUCCESS) {
+                if (csrfp_bucket_read(f, bb, b, rctx, &buf, &nbytes) == APR_SUCCESS) {
                     if (nbytes > 0) {
                         // Create a new string = overlap_buf + buf
                         const char *nbuf = apr_pstrcat(pool, rctx->overlap_buf,
@@ -1244,6 +4016,9 @@ static apr_status_t csrfp_out_filter(ap_filter_t *f, apr_bucket_brigade *bb)
                             } else if (rctx->state == op_body_init) {
                                 apr_size_t sz = strlen(buf) - strlen(marker) + sizeof("</body>") - 1;
                                 b = csrfp_inject(r, bb, b, rctx, buf, sz, 1);
+
+                                // <script> injected, rest of the brigade need not be read
+                                break;
                             }
                         } else {
                             // case - 3 or 4 '<body' not found in current bucket
@@ -1259,30 +4034,334 @@ static apr_status_t csrfp_out_filter(ap_filter_t *f, apr_bucket_brigade *bb)
     }
     
     const char *regenToken = apr_table_get(r->subprocess_env, "regen_csrfptoken");
-    if (regenToken && !strcasecmp(regenToken, CSRFP_REGEN_TOKEN)) {
+    if (rctx->tokenIssued == CSRFP_FALSE
+        && regenToken && !strcasecmp(regenToken, CSRFP_REGEN_TOKEN)) {
         /*
          * - Regenrate token
          * - Send it as output header
          */
-
-        // Start the sql connection
-        sqlite3 *db = csrfp_sql_init(r);
-        if (db == NULL) {
-            ap_log_rerror(APLOG_MARK, APLOG_NOERRNO|APLOG_ERR, 0, r,
-                      "CSRFP UNABLE TO ACCESS DB OBJECT");
-        } else {
-            setTokenCookie(r, db);
+        if (conf->tokenMode == token_mode_double_submit
+            || isTokenDue(r)) {
+            setTokenCookie(r);
         }
+        // else: client's token is reused, store isn't touched
+    }
+    rctx->tokenIssued = CSRFP_TRUE;
 
-        // Clean old expired values
-        csrfp_sql_table_clean(r, db);
+    if (rctx->spooling == CSRFP_TRUE) {
+        return csrfp_spool_brigade(f, rctx, bb);
+    }
 
-        // Close the sql connection
-        sqlite3_close(db);
+    if (rctx->state == op_body_end
+        || rctx->state == op_end) {
+        // Nothing left to inject or issue, detach so that
+        // later brigades of this response skip the filter
+        ap_remove_output_filter(f);
     }
     return ap_pass_brigade(f->next, bb);
 }
 
+#ifdef CSRFP_HTTPD_24
+/*
+ * Function: csrfp_pre_config
+ * Registers throttle lock, so that it can be set with Mutex directive
+ *
+ * Parameters: 
+ * pconf - config pool
+ * plog - log pool
+ * ptemp - temporary pool
+ *
+ * Returns:
+ * OK, or error of ap_mutex_register
+ */
+static int csrfp_pre_config(apr_pool_t *pconf, apr_pool_t *plog,
+                                apr_pool_t *ptemp)
+{
+    return ap_mutex_register(pconf, CSRFP_THROTTLE_MUTEX, NULL, APR_LOCK_DEFAULT, 0);
+}
+#endif
+
+/*
+ * Function: csrfp_store_conflict
+ * Compares connection settings of two servers sharing a token store,
+ * store is set up once, so they can't differ
+ *
+ * Parameters:
+ * a - csrfp_config of first server
+ * b - csrfp_config of other server
+ *
+ * Returns:
+ * const char* - name of first differing directive, NULL if none
+ */
+static const char *csrfp_store_conflict(csrfp_config *a, csrfp_config *b)
+{
+    if ((a->storeJournalMode == NULL) != (b->storeJournalMode == NULL)
+        || (a->storeJournalMode && strcasecmp(a->storeJournalMode, b->storeJournalMode))) {
+        return "storeJournalMode";
+    }
+    if ((a->storeSynchronous == NULL) != (b->storeSynchronous == NULL)
+        || (a->storeSynchronous && strcasecmp(a->storeSynchronous, b->storeSynchronous))) {
+        return "storeSynchronous";
+    }
+    if (a->storeBusyTimeout != b->storeBusyTimeout) {
+        return "storeBusyTimeout";
+    }
+    if (a->storeMmapSize != b->storeMmapSize) {
+        return "storeMmapSize";
+    }
+    if (a->storeCacheSize != b->storeCacheSize) {
+        return "storeCacheSize";
+    }
+    return NULL;
+}
+
+/*
+ * Function: csrfp_post_config
+ * Applies default configuration to every server, creates shared
+ * memory & lock of the throttle, in parent process
+ *
+ * Parameters: 
+ * pconf - config pool
+ * plog - log pool
+ * ptemp - temporary pool
+ * s - server_rec object
+ *
+ * Returns:
+ * OK, or HTTP_INTERNAL_SERVER_ERROR if shared memory can't be created
+ */
+static int csrfp_post_config(apr_pool_t *pconf, apr_pool_t *plog,
+                                apr_pool_t *ptemp, server_rec *s)
+{
+    void *data = NULL;
+    const char *userdata_key = "csrfp_post_config";
+    apr_status_t rv;
+    int throttled = 0;
+    server_rec *vs;
+
+    // Vhosts are merged by now, fill in what no directive set
+    for (vs = s; vs; vs = vs->next) {
+        csrfp_config *conf = ap_get_module_config(vs->module_config,
+                                                    &csrf_protector_module);
+        csrfp_dir_config *dconf = ap_get_module_config(vs->lookup_defaults,
+                                                    &csrf_protector_module);
+        csrfp_srv_config_defaults(pconf, conf);
+        if (conf->throttleRate > 0) ++throttled;
+
+        // Server wide policy, used as is outside of any section. Kept
+        // if resolved already, sections merged onto it are keyed by it
+        if (dconf->policy == NULL) {
+            dconf->policy = csrfp_policy_resolve(pconf, dconf);
+        }
+    }
+
+    // Servers sharing a store (same storeDirectory & storeShards) share
+    // its connections too, refuse settings that would silently be lost
+    for (vs = s; vs; vs = vs->next) {
+        csrfp_config *conf = ap_get_module_config(vs->module_config,
+                                                    &csrf_protector_module);
+        server_rec *os;
+        for (os = s; os != vs; os = os->next) {
+            csrfp_config *oconf = ap_get_module_config(os->module_config,
+                                                        &csrf_protector_module);
+            const char *directive;
+            if (oconf->storeShards != conf->storeShards
+                || strcmp(oconf->storeDirectory, conf->storeDirectory)) {
+                continue;
+            }
+            directive = csrfp_store_conflict(oconf, conf);
+            if (directive) {
+                ap_log_error(APLOG_MARK, APLOG_ERR, 0, vs,
+                             "CSRFP %s of %s:%u differs from %s:%u, which "
+                             "shares token store %s with it",
+                             directive, vs->server_hostname, vs->port,
+                             os->server_hostname, os->port, conf->storeDirectory);
+                return HTTP_INTERNAL_SERVER_ERROR;
+            }
+            break;
+        }
+    }
+
+    // post_config runs twice on startup, only second run matters
+    apr_pool_userdata_get(&data, userdata_key, s->process->pool);
+    if (data == NULL) {
+        apr_pool_userdata_set((const void *)1, userdata_key,
+                              apr_pool_cleanup_null, s->process->pool);
+        return OK;
+    }
+
+    throttleTable = NULL;
+    if (!throttled) {
+        return OK;
+    }
+
+    // anonymous shm, inherited by children on fork
+    rv = apr_shm_create(&throttleShm, sizeof(csrfp_throttle_slot) * CSRFP_THROTTLE_SLOTS,
+                        NULL, pconf);
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s,
+                     "CSRFP unable to create throttle shared memory");
+        return HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+#ifdef CSRFP_HTTPD_24
+    // Lock type & file are set by the Mutex directive, perms are set too
+    rv = ap_global_mutex_create(&throttleMutex, NULL, CSRFP_THROTTLE_MUTEX,
+                                NULL, s, pconf, 0);
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s,
+                     "CSRFP unable to create throttle lock");
+        return HTTP_INTERNAL_SERVER_ERROR;
+    }
+#else
+    rv = apr_global_mutex_create(&throttleMutex, NULL, APR_LOCK_DEFAULT, pconf);
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s,
+                     "CSRFP unable to create throttle lock");
+        return HTTP_INTERNAL_SERVER_ERROR;
+    }
+#endif
+
+#if defined(AP_NEED_SET_MUTEX_PERMS) && !defined(CSRFP_HTTPD_24)
+    rv = unixd_set_global_mutex_perms(throttleMutex);
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s,
+                     "CSRFP unable to set permissions of throttle lock");
+        return HTTP_INTERNAL_SERVER_ERROR;
+    }
+#endif
+
+    throttleTable = apr_shm_baseaddr_get(throttleShm);
+    memset(throttleTable, 0, sizeof(csrfp_throttle_slot) * CSRFP_THROTTLE_SLOTS);
+    return OK;
+}
+
+/*
+ * Function: csrfp_child_init
+ * Allocates per child state, when child process starts
+ *
+ * Parameters: 
+ * p - child pool
+ * s - server_rec object
+ *
+ * Returns:
+ * void
+ */
+static void csrfp_child_init(apr_pool_t *p, server_rec *s)
+{
+    csrfp_config *conf = ap_get_module_config(s->module_config,
+                                                &csrf_protector_module);
+    server_rec *vs;
+
+    if (throttleTable
+        && apr_global_mutex_child_init(&throttleMutex,
+                apr_global_mutex_lockfile(throttleMutex), p) != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, 0, s,
+                     "CSRFP unable to attach throttle lock, throttle disabled");
+        throttleTable = NULL;
+    }
+
+    attackRate = apr_pcalloc(p, sizeof(csrfp_rate_slot) * CSRFP_ATTACK_LOG_SLOTS);
+#if APR_HAS_THREADS
+    attackLog = apr_pcalloc(p, sizeof(csrfp_attack_record) * CSRFP_ATTACK_LOG_RING);
+    attackLog[0].server = s;
+    if (apr_thread_mutex_create(&attackLogMutex, APR_THREAD_MUTEX_DEFAULT, p) != APR_SUCCESS) {
+        attackLogMutex = NULL;
+    } else if (apr_thread_cond_create(&attackLogCond, p) == APR_SUCCESS
+        && apr_thread_create(&attackLogThread, NULL, csrfp_attacklog_writer,
+                             NULL, p) == APR_SUCCESS) {
+        // pre cleanup, writer's own pool is a subpool of p
+        apr_pool_pre_cleanup_register(p, NULL, csrfp_attacklog_stop);
+    } else {
+        // No writer, records are written inline (still rate limited)
+        attackLogThread = NULL;
+        ap_log_error(APLOG_MARK, APLOG_WARNING, 0, s,
+                     "CSRFP unable to start attack log writer, logging inline");
+    }
+#endif
+
+    // Section policies resolved from now on are kept for the child
+    if (apr_pool_create(&policyPool, p) != APR_SUCCESS
+#if APR_HAS_THREADS
+        || apr_thread_mutex_create(&policyMutex, APR_THREAD_MUTEX_DEFAULT, p)
+            != APR_SUCCESS
+#endif
+        ) {
+        // Resolve per request rather than race on the cache
+        policyUncached = 1;
+    }
+
+    if (conf->negCacheSize > 0) {
+        negCacheSize = conf->negCacheSize;
+        negCache = apr_pcalloc(p, sizeof(csrfp_neg_entry) * negCacheSize);
+#if APR_HAS_THREADS
+        if (apr_thread_mutex_create(&negCacheMutex, APR_THREAD_MUTEX_DEFAULT, p)
+            != APR_SUCCESS) {
+            negCache = NULL;
+        }
+#endif
+        // Registered after the mutex, so runs before it is destroyed
+        apr_pool_cleanup_register(p, s, csrfp_negcache_report, apr_pool_cleanup_null);
+    }
+
+    if (conf->tokenCacheSize > 0) {
+        int i;
+        tokenCacheSize = conf->tokenCacheSize;
+        tokenCache = apr_pcalloc(p, sizeof(csrfp_token_entry) * tokenCacheSize);
+        tokenCacheBuckets = apr_palloc(p, sizeof(int) * tokenCacheSize);
+        // All entries free, chained in LRU order
+        for (i = 0; i < tokenCacheSize; i++) {
+            tokenCacheBuckets[i] = -1;
+            tokenCache[i].hnext = -1;
+            tokenCache[i].prev = i - 1;
+            tokenCache[i].next = (i + 1 < tokenCacheSize) ? i + 1 : -1;
+        }
+        tokenCacheHead = 0;
+        tokenCacheTail = tokenCacheSize - 1;
+#if APR_HAS_THREADS
+        if (apr_thread_mutex_create(&tokenCacheMutex, APR_THREAD_MUTEX_DEFAULT, p)
+            != APR_SUCCESS) {
+            tokenCache = NULL;
+        }
+#endif
+    }
+
+    // Token stores, shared by servers with the same location
+    apr_pool_cleanup_register(p, s, csrfp_busy_report, apr_pool_cleanup_null);
+    storeByServer = apr_hash_make(p);
+    for (vs = s; vs; vs = vs->next) {
+        csrfp_store *store = csrfp_store_attach(p, vs);
+        server_rec **key = apr_pmemdup(p, &vs, sizeof(vs));
+        apr_hash_set(storeByServer, key, sizeof(vs), store);
+        if (vs == s) {
+            mainStore = store;
+        }
+    }
+
+#if APR_HAS_THREADS
+    if (conf->storeBatchSize > 0) {
+        batchSize = conf->storeBatchSize;
+        batchCapacity = batchSize * CSRFP_STORE_BATCH_QUEUE;
+        batchInterval = apr_time_from_msec(conf->storeBatchInterval);
+        batchQueue = apr_pcalloc(p, sizeof(csrfp_pending_issue) * batchCapacity);
+        // Writer opens its connections lazily, from its own pool
+        if (apr_pool_create(&batchPool, p) == APR_SUCCESS
+            && apr_thread_mutex_create(&batchMutex, APR_THREAD_MUTEX_DEFAULT, p) == APR_SUCCESS
+            && apr_thread_cond_create(&batchCond, p) == APR_SUCCESS
+            && apr_thread_create(&batchThread, NULL, csrfp_batch_writer,
+                                 NULL, p) == APR_SUCCESS) {
+            // pre cleanup, writer's own pool is a subpool of p
+            apr_pool_pre_cleanup_register(p, NULL, csrfp_batch_stop);
+        } else {
+            // Issuances are written inline
+            batchQueue = NULL;
+            batchThread = NULL;
+            ap_log_error(APLOG_MARK, APLOG_WARNING, 0, s,
+                         "CSRFP unable to start batch writer, writing inline");
+        }
+    }
+#endif
+}
+
 /*
  * Function: csrfp_insert_filter
  * Registers in filter -- csrfp_in_filter
@@ -1295,53 +4374,365 @@ static apr_status_t csrfp_out_filter(ap_filter_t *f, apr_bucket_brigade *bb)
  */
 static void csrfp_insert_filter(request_rec *r)
 {
+    // Subrequest output ends up in the main request's response
+    // which already has this filter
+    if (r->main) {
+        return;
+    }
     ap_add_output_filter("csrfp_out_filter", NULL, r, r->connection);
 }
 
 
 /**
  * Handler to allocate memory to config object
- * And allocae default values to variabled
+ * All fields are left unset, so that vhosts can be merged
  *
- * @param: standard parameters, @return void
+ * @param: standard parameters, @return csrfp_config
  */
 static void *csrfp_srv_config_create(apr_pool_t *p, server_rec *s)
 {
-    // Registering default configurations
-    config = apr_pcalloc(p, sizeof(csrfp_config));
-    config->flag = CSRFP_TRUE;
-    config->action = forbidden;
-    config->tokenLength = DEFAULT_TOKEN_LENGTH;
-
-    // Allocate memory & assign default value for tokenName
-    config->tokenName = apr_pcalloc(p, CSRFP_TOKEN_NAME_MAXLENGTH);
-    apr_cpystrn(config->tokenName, CSRFP_TOKEN,
-        CSRFP_TOKEN_NAME_MAXLENGTH);
-
-    // Allocates memory, and assign defalut value For jsFilePath
-    config->jsFilePath = apr_pcalloc(p, CSRFP_URI_MAXLENGTH);
-    apr_cpystrn(config->jsFilePath, DEFAULT_JS_FILE_PATH,
-            CSRFP_URI_MAXLENGTH);
-
-    // Allocates memory, and assign defalut value For errorRedirectionUri
-    config->errorRedirectionUri = apr_pcalloc(p, CSRFP_URI_MAXLENGTH);
-    apr_cpystrn(config->errorRedirectionUri, DEFAULT_REDIRECT_URL,
-            CSRFP_URI_MAXLENGTH);
-
-    // Allocates memory, and assign defalut value For errorCustomMessage
-    config->errorCustomMessage = apr_pcalloc(p, CSRFP_ERROR_MESSAGE_MAXLENGTH);
-    apr_cpystrn(config->errorCustomMessage, DEFAULT_ERROR_MESSAGE,
-            CSRFP_ERROR_MESSAGE_MAXLENGTH);
-
-    // Allocates memory, and assign defalut value For disablesJsMessage
-    config->disablesJsMessage = apr_pcalloc(p, CSRFP_DISABLED_JS_MESSAGE_MAXLENGTH);
-    apr_cpystrn(config->disablesJsMessage, DEFAULT_DISABLED_JS_MESSSAGE,
-            CSRFP_DISABLED_JS_MESSAGE_MAXLENGTH);
-
-    // Allocate memory and set regex for ignore-pattern regex object
-    config->ignore_pattern = ap_pregcomp(p, CSRFP_IGNORE_PATTERN, AP_REG_ICASE);
+    csrfp_config *conf = apr_pcalloc(p, sizeof(csrfp_config));
+    conf->tokenLength = CSRFP_UNSET;
+
+    // Allocate memory and set regex for ignore-pattern regex object
+    conf->ignore_pattern = ap_pregcomp(p, CSRFP_IGNORE_PATTERN, AP_REG_ICASE);
+
+    conf->spoolSize = CSRFP_UNSET;
+    conf->regenForBodiless = CSRFP_FLAG_UNSET;
+    conf->validationPhase = phase_unset;
+    conf->originCheck = origin_check_unset;
+    conf->trustedOrigins = NULL;
+    conf->tokenMode = token_mode_unset;
+    conf->negCacheSize = CSRFP_UNSET;
+    conf->negCacheTTL = CSRFP_UNSET;
+    conf->tokenCacheSize = CSRFP_UNSET;
+    conf->tokenRotateAge = CSRFP_UNSET;
+    conf->tokenRotateUses = CSRFP_UNSET;
+    conf->tokenWindow = CSRFP_UNSET;
+    conf->storeBatchSize = CSRFP_UNSET;
+    conf->storeBatchInterval = CSRFP_UNSET;
+    conf->storeShards = CSRFP_UNSET;
+    conf->storeDirectory = NULL;
+    conf->storeJournalMode = NULL;
+    conf->storeSynchronous = NULL;
+    conf->storeBusyTimeout = CSRFP_UNSET;
+    conf->storeMmapSize = CSRFP_UNSET;
+    conf->storeCacheSize = CSRFP_UNSET;
+    conf->attackLogRate = CSRFP_UNSET;
+    conf->throttleRate = CSRFP_UNSET;
+    conf->throttleBurst = CSRFP_UNSET;
+    conf->throttleAction = throttle_action_unset;
+    conf->throttleKey = throttle_key_unset;
+
+    return conf;
+}
+
+/**
+ * Handler to merge config of a virtual host with main server's
+ * Values set in the vhost win, rest are taken from main server
+ *
+ * @param: standard parameters, @return csrfp_config
+ */
+static void *csrfp_srv_config_merge(apr_pool_t *p, void *basev, void *addv)
+{
+    csrfp_config *base = basev;
+    csrfp_config *add = addv;
+    csrfp_config *conf = apr_pcalloc(p, sizeof(csrfp_config));
+
+#define CSRFP_MERGE(field, unset) \
+    conf->field = (add->field != (unset)) ? add->field : base->field
+
+    CSRFP_MERGE(tokenLength, CSRFP_UNSET);
+    CSRFP_MERGE(tokenName, NULL);
+    CSRFP_MERGE(spoolSize, CSRFP_UNSET);
+    CSRFP_MERGE(injectionMarker, NULL);
+    CSRFP_MERGE(regenForBodiless, CSRFP_FLAG_UNSET);
+    CSRFP_MERGE(validationPhase, phase_unset);
+    CSRFP_MERGE(originCheck, origin_check_unset);
+    CSRFP_MERGE(trustedOrigins, NULL);
+    CSRFP_MERGE(tokenMode, token_mode_unset);
+    CSRFP_MERGE(negCacheSize, CSRFP_UNSET);
+    CSRFP_MERGE(negCacheTTL, CSRFP_UNSET);
+    CSRFP_MERGE(tokenCacheSize, CSRFP_UNSET);
+    CSRFP_MERGE(tokenRotateAge, CSRFP_UNSET);
+    CSRFP_MERGE(tokenRotateUses, CSRFP_UNSET);
+    CSRFP_MERGE(tokenWindow, CSRFP_UNSET);
+    CSRFP_MERGE(storeBatchSize, CSRFP_UNSET);
+    CSRFP_MERGE(storeBatchInterval, CSRFP_UNSET);
+    CSRFP_MERGE(storeShards, CSRFP_UNSET);
+    CSRFP_MERGE(storeDirectory, NULL);
+    CSRFP_MERGE(storeJournalMode, NULL);
+    CSRFP_MERGE(storeSynchronous, NULL);
+    CSRFP_MERGE(storeBusyTimeout, CSRFP_UNSET);
+    CSRFP_MERGE(storeMmapSize, CSRFP_UNSET);
+    CSRFP_MERGE(storeCacheSize, CSRFP_UNSET);
+    CSRFP_MERGE(attackLogRate, CSRFP_UNSET);
+    CSRFP_MERGE(throttleRate, CSRFP_UNSET);
+    CSRFP_MERGE(throttleBurst, CSRFP_UNSET);
+    CSRFP_MERGE(throttleAction, throttle_action_unset);
+    CSRFP_MERGE(throttleKey, throttle_key_unset);
+
+#undef CSRFP_MERGE
+
+    conf->ignore_pattern = base->ignore_pattern;
+
+    return conf;
+}
+
+/**
+ * Assigns default values to fields no directive has set
+ * Called for every server in post_config, after merging
+ *
+ * @param: p - config pool, conf - csrfp_config, @return void
+ */
+static void csrfp_srv_config_defaults(apr_pool_t *p, csrfp_config *conf)
+{
+    if (conf->tokenLength == CSRFP_UNSET)
+        conf->tokenLength = DEFAULT_TOKEN_LENGTH;
+    if (conf->tokenName == NULL)
+        conf->tokenName = apr_pstrdup(p, CSRFP_TOKEN);
+    if (conf->spoolSize == CSRFP_UNSET)
+        conf->spoolSize = DEFAULT_SPOOL_SIZE;
+    // "" set explicitly means no marker, search <body
+    if (conf->injectionMarker && *conf->injectionMarker == '\0')
+        conf->injectionMarker = NULL;
+    if (conf->regenForBodiless == CSRFP_FLAG_UNSET)
+        conf->regenForBodiless = CSRFP_FALSE;
+    if (conf->validationPhase == phase_unset)
+        conf->validationPhase = phase_fixups;
+    if (conf->originCheck == origin_check_unset)
+        conf->originCheck = origin_check_off;
+    if (conf->tokenMode == token_mode_unset)
+        conf->tokenMode = token_mode_session;
+    if (conf->negCacheSize == CSRFP_UNSET)
+        conf->negCacheSize = DEFAULT_NEG_CACHE_SIZE;
+    if (conf->negCacheTTL == CSRFP_UNSET)
+        conf->negCacheTTL = DEFAULT_NEG_CACHE_TTL;
+    if (conf->tokenCacheSize == CSRFP_UNSET)
+        conf->tokenCacheSize = DEFAULT_TOKEN_CACHE_SIZE;
+    if (conf->tokenRotateAge == CSRFP_UNSET)
+        conf->tokenRotateAge = 0;
+    if (conf->tokenRotateUses == CSRFP_UNSET)
+        conf->tokenRotateUses = 0;
+    if (conf->tokenWindow == CSRFP_UNSET)
+        conf->tokenWindow = DEFAULT_TOKEN_WINDOW;
+    if (conf->storeBatchSize == CSRFP_UNSET)
+        conf->storeBatchSize = 0;
+    if (conf->storeBatchInterval == CSRFP_UNSET)
+        conf->storeBatchInterval = DEFAULT_STORE_BATCH_INTERVAL;
+    if (conf->storeShards == CSRFP_UNSET)
+        conf->storeShards = 1;
+    if (conf->storeDirectory == NULL)
+        conf->storeDirectory = DEFAULT_STORE_DIRECTORY;
+    if (conf->storeBusyTimeout == CSRFP_UNSET)
+        conf->storeBusyTimeout = DEFAULT_STORE_BUSY_TIMEOUT;
+    if (conf->attackLogRate == CSRFP_UNSET)
+        conf->attackLogRate = DEFAULT_ATTACK_LOG_RATE;
+    if (conf->throttleRate == CSRFP_UNSET)
+        conf->throttleRate = 0;
+    if (conf->throttleBurst == CSRFP_UNSET)
+        conf->throttleBurst = DEFAULT_THROTTLE_BURST;
+    if (conf->throttleAction == throttle_action_unset)
+        conf->throttleAction = throttle_429;
+    if (conf->throttleKey == throttle_key_unset)
+        conf->throttleKey = throttle_key_ip;
+}
+
+/**
+ * Handler to allocate memory to per directory config object
+ * All fields are left unset, so that sections can be merged
+ *
+ * @param: standard parameters, @return csrfp_dir_config
+ */
+static void *csrfp_dir_config_create(apr_pool_t *p, char *dir)
+{
+    csrfp_dir_config *dconf = apr_pcalloc(p, sizeof(csrfp_dir_config));
+    dconf->flag = CSRFP_FLAG_UNSET;
+    dconf->action = action_unset;
+    return dconf;
+}
+
+/**
+ * Handler to merge per directory configs, values set in the inner
+ * section win. Policy of the result is resolved right away
+ *
+ * @param: standard parameters, @return csrfp_dir_config
+ */
+static void *csrfp_dir_config_merge(apr_pool_t *p, void *basev, void *addv)
+{
+    csrfp_dir_config *base = basev;
+    csrfp_dir_config *add = addv;
+    csrfp_dir_config *dconf = apr_pcalloc(p, sizeof(csrfp_dir_config));
+
+#define CSRFP_MERGE(field, unset) \
+    dconf->field = (add->field != (unset)) ? add->field : base->field
+
+    CSRFP_MERGE(flag, CSRFP_FLAG_UNSET);
+    CSRFP_MERGE(action, action_unset);
+    CSRFP_MERGE(errorRedirectionUri, NULL);
+    CSRFP_MERGE(errorCustomMessage, NULL);
+    CSRFP_MERGE(jsFilePath, NULL);
+    CSRFP_MERGE(disablesJsMessage, NULL);
+
+#undef CSRFP_MERGE
+
+    // GET rules aren't added up, inner section's list replaces the outer
+    if (add->getRules) {
+        dconf->getRules = add->getRules;
+        dconf->getRulesTail = add->getRulesTail;
+    } else {
+        dconf->getRules = base->getRules;
+        dconf->getRulesTail = base->getRulesTail;
+    }
+
+    // Base policy, resolved on first use if base is plain server config.
+    // One resolved while serving a request lives only as long as it,
+    // so it isn't a cache key
+    int transient = (base->policy == NULL && policyPool != NULL);
+    if (base->policy == NULL) {
+        base->policy = csrfp_policy_resolve(p, base);
+    }
+
+    // Section setting nothing of ours shares the base policy
+    if (add->flag == CSRFP_FLAG_UNSET && add->action == action_unset
+        && !add->errorRedirectionUri && !add->errorCustomMessage
+        && !add->jsFilePath && !add->disablesJsMessage && !add->getRules) {
+        dconf->policy = base->policy;
+        return dconf;
+    }
+    if (policyUncached || transient) {
+        dconf->policy = csrfp_policy_overlay(p, base->policy, add);
+        return dconf;
+    }
+
+    // Same section onto same base policy always merges the same, so
+    // result is kept on the section (add lives as long as the config).
+    // Per request merges run in r->pool, results go to policyPool
+    apr_pool_t *keep = policyPool ? policyPool : p;
+    csrfp_policy_link *link;
+#if APR_HAS_THREADS
+    if (policyMutex) apr_thread_mutex_lock(policyMutex);
+#endif
+    for (link = add->merges; link; link = link->next) {
+        if (link->base == base->policy) {
+            break;
+        }
+    }
+    if (link == NULL) {
+        link = apr_palloc(keep, sizeof(csrfp_policy_link));
+        link->base = base->policy;
+        link->merged = csrfp_policy_overlay(keep, base->policy, add);
+        link->next = add->merges;
+        add->merges = link;
+    }
+    dconf->policy = link->merged;
+#if APR_HAS_THREADS
+    if (policyMutex) apr_thread_mutex_unlock(policyMutex);
+#endif
+
+    return dconf;
+}
+
+/**
+ * Joins verifyGetFor rules into the list passed on to the js
+ *
+ * @param: p - pool, node - first rule, @return rule string, "" if none
+ */
+static const char *csrfp_policy_rule_string(apr_pool_t *p, struct getRuleNode *node)
+{
+    char *getRuleString = NULL;
+    while (node != NULL) {
+        if (getRuleString)
+            getRuleString = apr_pstrcat(p, getRuleString, ",'" , node->patternString , "'", NULL);
+        else
+            getRuleString = apr_pstrcat(p, "'" , node->patternString , "'", NULL);
+
+        node = node->next;
+    }
+    return getRuleString ? getRuleString : "";
+}
+
+/**
+ * Merges settings of a section onto policy of the enclosing one
+ *
+ * @param: p - pool, base - csrfp_policy, add - csrfp_dir_config
+ * @return csrfp_policy
+ */
+static csrfp_policy *csrfp_policy_overlay(apr_pool_t *p, const csrfp_policy *base,
+                                          const csrfp_dir_config *add)
+{
+    csrfp_policy *policy = apr_pmemdup(p, base, sizeof(csrfp_policy));
+
+    if (add->flag != CSRFP_FLAG_UNSET)
+        policy->flag = add->flag;
+    if (add->action != action_unset)
+        policy->action = add->action;
+    if (add->errorRedirectionUri)
+        policy->errorRedirectionUri = add->errorRedirectionUri;
+    if (add->errorCustomMessage)
+        policy->errorCustomMessage = add->errorCustomMessage;
+    if (add->jsFilePath)
+        policy->jsFilePath = add->jsFilePath;
+
+    // GET rules aren't added up, inner section's list replaces the outer
+    if (add->getRules) {
+        policy->getRules = add->getRules;
+        policy->getRuleString = csrfp_policy_rule_string(p, add->getRules);
+    }
+    if (add->disablesJsMessage) {
+        policy->noscript = apr_psprintf(p, "\n<noscript>\n%s\n</noscript>",
+                                        add->disablesJsMessage);
+    }
+
+    return policy;
+}
+
+/**
+ * Resolves policy of a per directory config, filling in defaults,
+ * joining GET rules & building the <noscript> payload
+ *
+ * @param: p - pool, dconf - csrfp_dir_config, @return csrfp_policy
+ */
+static csrfp_policy *csrfp_policy_resolve(apr_pool_t *p, const csrfp_dir_config *dconf)
+{
+    csrfp_policy *policy = apr_pcalloc(p, sizeof(csrfp_policy));
+
+    policy->flag = (dconf->flag == CSRFP_FLAG_UNSET) ? CSRFP_TRUE : dconf->flag;
+    policy->action = (dconf->action == action_unset) ? forbidden : dconf->action;
+    policy->errorRedirectionUri = dconf->errorRedirectionUri
+                    ? dconf->errorRedirectionUri : DEFAULT_REDIRECT_URL;
+    policy->errorCustomMessage = dconf->errorCustomMessage
+                    ? dconf->errorCustomMessage : DEFAULT_ERROR_MESSAGE;
+    policy->jsFilePath = dconf->jsFilePath
+                    ? dconf->jsFilePath : DEFAULT_JS_FILE_PATH;
+    policy->getRules = dconf->getRules;
+
+    // Generate the rule string to be appended to js
+    policy->getRuleString = csrfp_policy_rule_string(p, dconf->getRules);
+
+    policy->noscript = apr_psprintf(p, "\n<noscript>\n%s\n</noscript>",
+                dconf->disablesJsMessage
+                    ? dconf->disablesJsMessage : DEFAULT_DISABLED_JS_MESSSAGE);
+
+    return policy;
+}
+
+/**
+ * Returns policy in effect for the request
+ *
+ * @param: r - request_rec object, @return csrfp_policy
+ */
+static const csrfp_policy *csrfp_get_policy(request_rec *r)
+{
+    csrfp_dir_config *dconf = ap_get_module_config(r->per_dir_config,
+                                                &csrf_protector_module);
 
-    return config;
+    if (dconf->policy == NULL) {
+        // Not resolved at config time, e.g. config created by
+        // another module; resolve for this request only
+        return csrfp_policy_resolve(r->pool, dconf);
+    }
+    return dconf->policy;
 }
 
 //=============================================================
@@ -1351,17 +4742,22 @@ static void *csrfp_srv_config_create(apr_pool_t *p, server_rec *s)
 /** csrfEnable **/
 const char *csrfp_enable_cmd(cmd_parms *cmd, void *cfg, const char *arg)
 {
-    if(!strcasecmp(arg, "off")) config->flag = CSRFP_FALSE;
-    else config->flag = CSRFP_TRUE;
+    csrfp_dir_config *dconf = cfg;
+
+    if(!strcasecmp(arg, "off")) dconf->flag = CSRFP_FALSE;
+    else dconf->flag = CSRFP_TRUE;
     return NULL;
 }
 
 /** tokenName **/
 const char *csrfp_tokenName_cmd(cmd_parms *cmd, void *cfg, const char *arg)
 {
+    csrfp_config *conf = ap_get_module_config(cmd->server->module_config,
+                                                &csrf_protector_module);
+
     if(strlen(arg) > 0) {
-        apr_cpystrn(config->tokenName, arg,
-        CSRFP_TOKEN_NAME_MAXLENGTH);
+        conf->tokenName = apr_pstrndup(cmd->pool, arg,
+        CSRFP_TOKEN_NAME_MAXLENGTH - 1);
     }
     // Else default value will be set
 
@@ -1371,17 +4767,19 @@ const char *csrfp_tokenName_cmd(cmd_parms *cmd, void *cfg, const char *arg)
 /** csrfAction **/
 const char *csrfp_action_cmd(cmd_parms *cmd, void *cfg, const char *arg)
 {
+    csrfp_dir_config *dconf = cfg;
+
     if(!strcasecmp(arg, "forbidden"))
-        config->action = forbidden;
+        dconf->action = forbidden;
     else if (!strcasecmp(arg, "strip"))
-        config->action = strip;
+        dconf->action = strip;
     else if (!strcasecmp(arg, "redirect"))
-        config->action = redirect;
+        dconf->action = redirect;
     else if (!strcasecmp(arg, "message"))
-        config->action = message;
+        dconf->action = message;
     else if (!strcasecmp(arg, "internal_server_error"))
-        config->action = internal_server_error;
-    else config->action = forbidden;       //default
+        dconf->action = internal_server_error;
+    else dconf->action = forbidden;       //default
 
     return NULL;
 }
@@ -1389,11 +4787,13 @@ const char *csrfp_action_cmd(cmd_parms *cmd, void *cfg, const char *arg)
 /** errorRedirectionUri **/
 const char *csrfp_errorRedirectionUri_cmd(cmd_parms *cmd, void *cfg, const char *arg)
 {
+    csrfp_dir_config *dconf = cfg;
+
     if(strlen(arg) > 0) {
-        apr_cpystrn(config->errorRedirectionUri, arg,
-        CSRFP_URI_MAXLENGTH);
+        dconf->errorRedirectionUri = apr_pstrndup(cmd->pool, arg,
+        CSRFP_URI_MAXLENGTH - 1);
     }
-    else config->errorRedirectionUri = NULL;
+    else dconf->errorRedirectionUri = "";
 
     return NULL;
 }
@@ -1401,11 +4801,13 @@ const char *csrfp_errorRedirectionUri_cmd(cmd_parms *cmd, void *cfg, const char
 /** errorCustomMessage **/
 const char *csrfp_errorCustomMessage_cmd(cmd_parms *cmd, void *cfg, const char *arg)
 {
+    csrfp_dir_config *dconf = cfg;
+
     if(strlen(arg) > 0) {
-        apr_cpystrn(config->errorCustomMessage, arg,
-        CSRFP_ERROR_MESSAGE_MAXLENGTH);
+        dconf->errorCustomMessage = apr_pstrndup(cmd->pool, arg,
+        CSRFP_ERROR_MESSAGE_MAXLENGTH - 1);
     }
-    else config->errorCustomMessage = NULL;
+    else dconf->errorCustomMessage = "";
 
     return NULL;
 }
@@ -1413,9 +4815,11 @@ const char *csrfp_errorCustomMessage_cmd(cmd_parms *cmd, void *cfg, const char *
 /** jsFilePath **/
 const char *csrfp_jsFilePath_cmd(cmd_parms *cmd, void *cfg, const char *arg)
 {
+    csrfp_dir_config *dconf = cfg;
+
     if(strlen(arg) > 0) {
-        apr_cpystrn(config->jsFilePath, arg,
-            CSRFP_URI_MAXLENGTH);
+        dconf->jsFilePath = apr_pstrndup(cmd->pool, arg,
+            CSRFP_URI_MAXLENGTH - 1);
     }
     //no else as default config shall come to effect
 
@@ -1425,12 +4829,15 @@ const char *csrfp_jsFilePath_cmd(cmd_parms *cmd, void *cfg, const char *arg)
 /** tokenLength **/
 const char *csrfp_tokenLength_cmd(cmd_parms *cmd, void *cfg, const char *arg)
 {
+    csrfp_config *conf = ap_get_module_config(cmd->server->module_config,
+                                                &csrf_protector_module);
+
     if(strlen(arg) > 0) {
         int length = atoi(arg);
         if (length < DEFAULT_TOKEN_MINIMUM_LENGTH
             || !length)
             return NULL;
-        config->tokenLength = length;
+        conf->tokenLength = length;
     }
     //no else as default config shall come to effect
 
@@ -1440,9 +4847,11 @@ const char *csrfp_tokenLength_cmd(cmd_parms *cmd, void *cfg, const char *arg)
 /** disablesJsMessage **/
 const char *csrfp_disablesJsMessage_cmd(cmd_parms *cmd, void *cfg, const char *arg)
 {
+    csrfp_dir_config *dconf = cfg;
+
     if(strlen(arg) > 0) {
-        apr_cpystrn(config->disablesJsMessage, arg,
-            CSRFP_DISABLED_JS_MESSAGE_MAXLENGTH);
+        dconf->disablesJsMessage = apr_pstrndup(cmd->pool, arg,
+            CSRFP_DISABLED_JS_MESSAGE_MAXLENGTH - 1);
     }
     //no else as default config shall come to effect
 
@@ -1452,6 +4861,8 @@ const char *csrfp_disablesJsMessage_cmd(cmd_parms *cmd, void *cfg, const char *a
 /** verifyGetFor **/
 const char *csrfp_verifyGetFor_cmd(cmd_parms *cmd, void *cfg, const char *arg)
 {
+    csrfp_dir_config *dconf = cfg;
+
     if(strlen(arg) > 0) {
         // Create a Node
         struct getRuleNode *p;
@@ -1462,16 +4873,437 @@ const char *csrfp_verifyGetFor_cmd(cmd_parms *cmd, void *cfg, const char *arg)
         p->pattern = apr_pcalloc(cmd->pool, sizeof (p->pattern));
         ap_regcomp(p->pattern, arg, 0);
 
-        // Add to linked list
-        if (getTop == NULL) {
+        // Add to linked list of this section
+        if (dconf->getRules == NULL) {
             // First element
-            getTop = p;
-            getPointer = p;
+            dconf->getRules = p;
+            dconf->getRulesTail = p;
         } else {
-            getPointer->next = p;
-            getPointer = p;
+            dconf->getRulesTail->next = p;
+            dconf->getRulesTail = p;
+        }
+    }
+
+    return NULL;
+}
+
+/** spoolSize **/
+const char *csrfp_spoolSize_cmd(cmd_parms *cmd, void *cfg, const char *arg)
+{
+    csrfp_config *conf = ap_get_module_config(cmd->server->module_config,
+                                                &csrf_protector_module);
+
+    apr_off_t size;
+    char *errp = NULL;
+    if (apr_strtoff(&size, arg, &errp, 10) != APR_SUCCESS
+        || *errp != '\0' || size < 0)
+        return "spoolSize must be a non negative number of bytes";
+    conf->spoolSize = size;
+
+    return NULL;
+}
+
+/** injectionMarker **/
+const char *csrfp_injectionMarker_cmd(cmd_parms *cmd, void *cfg, const char *arg)
+{
+    csrfp_config *conf = ap_get_module_config(cmd->server->module_config,
+                                                &csrf_protector_module);
+
+    if(strlen(arg) > 0) {
+        conf->injectionMarker = apr_pstrdup(cmd->pool, arg);
+    }
+    // "" overrides a marker of main server, cleared in defaults
+    else conf->injectionMarker = "";
+
+    return NULL;
+}
+
+/** regenForBodiless **/
+const char *csrfp_regenForBodiless_cmd(cmd_parms *cmd, void *cfg, const char *arg)
+{
+    csrfp_config *conf = ap_get_module_config(cmd->server->module_config,
+                                                &csrf_protector_module);
+
+    if(!strcasecmp(arg, "on")) conf->regenForBodiless = CSRFP_TRUE;
+    else conf->regenForBodiless = CSRFP_FALSE;
+    return NULL;
+}
+
+/** validationPhase **/
+const char *csrfp_validationPhase_cmd(cmd_parms *cmd, void *cfg, const char *arg)
+{
+    csrfp_config *conf = ap_get_module_config(cmd->server->module_config,
+                                                &csrf_protector_module);
+
+    if(!strcasecmp(arg, "post_read_request"))
+        conf->validationPhase = phase_post_read_request;
+    else if (!strcasecmp(arg, "header_parser"))
+        conf->validationPhase = phase_header_parser;
+    else if (!strcasecmp(arg, "fixups"))
+        conf->validationPhase = phase_fixups;
+    else
+        return "validationPhase must be one of post_read_request, header_parser, fixups";
+
+    return NULL;
+}
+
+/** originCheck **/
+const char *csrfp_originCheck_cmd(cmd_parms *cmd, void *cfg, const char *arg)
+{
+    csrfp_config *conf = ap_get_module_config(cmd->server->module_config,
+                                                &csrf_protector_module);
+
+    if(!strcasecmp(arg, "off"))
+        conf->originCheck = origin_check_off;
+    else if (!strcasecmp(arg, "reject"))
+        conf->originCheck = origin_check_reject;
+    else if (!strcasecmp(arg, "trust"))
+        conf->originCheck = origin_check_trust;
+    else
+        return "originCheck must be one of off, reject, trust";
+
+    return NULL;
+}
+
+/** trustedOrigin **/
+const char *csrfp_trustedOrigin_cmd(cmd_parms *cmd, void *cfg, const char *arg)
+{
+    csrfp_config *conf = ap_get_module_config(cmd->server->module_config,
+                                                &csrf_protector_module);
+    apr_size_t len = strlen(arg);
+
+    if (!ap_strstr_c(arg, "://") || len < 4 || strchr(ap_strstr_c(arg, "://") + 3, '/'))
+        return "trustedOrigin must be scheme://host[:port], without a path";
+
+    // Vhost's list replaces the one of main server
+    if (conf->trustedOrigins == NULL)
+        conf->trustedOrigins = apr_array_make(cmd->pool, 2, sizeof(const char *));
+    APR_ARRAY_PUSH(conf->trustedOrigins, const char *) = apr_pstrdup(cmd->pool, arg);
+
+    return NULL;
+}
+
+/** csrfpTokenMode **/
+const char *csrfp_tokenMode_cmd(cmd_parms *cmd, void *cfg, const char *arg)
+{
+    csrfp_config *conf = ap_get_module_config(cmd->server->module_config,
+                                                &csrf_protector_module);
+
+    if(!strcasecmp(arg, "session"))
+        conf->tokenMode = token_mode_session;
+    else if (!strcasecmp(arg, "double-submit"))
+        conf->tokenMode = token_mode_double_submit;
+    else
+        return "csrfpTokenMode must be one of session, double-submit";
+
+    return NULL;
+}
+
+/** negativeCacheSize **/
+const char *csrfp_negativeCacheSize_cmd(cmd_parms *cmd, void *cfg, const char *arg)
+{
+    csrfp_config *conf = ap_get_module_config(cmd->server->module_config,
+                                                &csrf_protector_module);
+
+    int size = atoi(arg);
+    if (size < 0 || (size == 0 && strcmp(arg, "0")))
+        return "negativeCacheSize must be a non negative number";
+    conf->negCacheSize = size;
+
+    return NULL;
+}
+
+/** negativeCacheTTL **/
+const char *csrfp_negativeCacheTTL_cmd(cmd_parms *cmd, void *cfg, const char *arg)
+{
+    csrfp_config *conf = ap_get_module_config(cmd->server->module_config,
+                                                &csrf_protector_module);
+
+    int ttl = atoi(arg);
+    if (ttl <= 0)
+        return "negativeCacheTTL must be a positive number of seconds";
+    conf->negCacheTTL = ttl;
+
+    return NULL;
+}
+
+/** tokenCacheSize **/
+const char *csrfp_tokenCacheSize_cmd(cmd_parms *cmd, void *cfg, const char *arg)
+{
+    csrfp_config *conf = ap_get_module_config(cmd->server->module_config,
+                                                &csrf_protector_module);
+
+    int size = atoi(arg);
+    if (size < 0 || (size == 0 && strcmp(arg, "0")))
+        return "tokenCacheSize must be a non negative number";
+    conf->tokenCacheSize = size;
+
+    return NULL;
+}
+
+/** tokenRotateAge **/
+const char *csrfp_tokenRotateAge_cmd(cmd_parms *cmd, void *cfg, const char *arg)
+{
+    csrfp_config *conf = ap_get_module_config(cmd->server->module_config,
+                                                &csrf_protector_module);
+
+    int age = atoi(arg);
+    if (age < 0 || (age == 0 && strcmp(arg, "0")))
+        return "tokenRotateAge must be a non negative number of seconds";
+    conf->tokenRotateAge = age;
+
+    return NULL;
+}
+
+/** tokenRotateUses **/
+const char *csrfp_tokenRotateUses_cmd(cmd_parms *cmd, void *cfg, const char *arg)
+{
+    csrfp_config *conf = ap_get_module_config(cmd->server->module_config,
+                                                &csrf_protector_module);
+
+    int uses = atoi(arg);
+    if (uses < 0 || (uses == 0 && strcmp(arg, "0")))
+        return "tokenRotateUses must be a non negative number";
+    conf->tokenRotateUses = uses;
+
+    return NULL;
+}
+
+/** tokenWindow **/
+const char *csrfp_tokenWindow_cmd(cmd_parms *cmd, void *cfg, const char *arg)
+{
+    csrfp_config *conf = ap_get_module_config(cmd->server->module_config,
+                                                &csrf_protector_module);
+
+    int window = atoi(arg);
+    if (window < 1 || window > CSRFP_TOKEN_WINDOW_MAX)
+        return apr_psprintf(cmd->pool, "tokenWindow must be between 1 and %d",
+                            CSRFP_TOKEN_WINDOW_MAX);
+    conf->tokenWindow = window;
+
+    return NULL;
+}
+
+/** storeBatchSize **/
+const char *csrfp_storeBatchSize_cmd(cmd_parms *cmd, void *cfg, const char *arg)
+{
+    csrfp_config *conf = ap_get_module_config(cmd->server->module_config,
+                                                &csrf_protector_module);
+
+    int size = atoi(arg);
+    if (size < 0 || (size == 0 && strcmp(arg, "0")))
+        return "storeBatchSize must be a non negative number";
+    conf->storeBatchSize = size;
+
+    return NULL;
+}
+
+/** storeBatchInterval **/
+const char *csrfp_storeBatchInterval_cmd(cmd_parms *cmd, void *cfg, const char *arg)
+{
+    csrfp_config *conf = ap_get_module_config(cmd->server->module_config,
+                                                &csrf_protector_module);
+
+    int interval = atoi(arg);
+    if (interval <= 0)
+        return "storeBatchInterval must be a positive number of milliseconds";
+    conf->storeBatchInterval = interval;
+
+    return NULL;
+}
+
+/** storeShards **/
+const char *csrfp_storeShards_cmd(cmd_parms *cmd, void *cfg, const char *arg)
+{
+    csrfp_config *conf = ap_get_module_config(cmd->server->module_config,
+                                                &csrf_protector_module);
+
+    int shards = atoi(arg);
+    if (shards < 1 || shards > CSRFP_STORE_SHARDS_MAX)
+        return apr_psprintf(cmd->pool, "storeShards must be between 1 and %d",
+                            CSRFP_STORE_SHARDS_MAX);
+    conf->storeShards = shards;
+
+    return NULL;
+}
+
+/** storeDirectory **/
+const char *csrfp_storeDirectory_cmd(cmd_parms *cmd, void *cfg, const char *arg)
+{
+    csrfp_config *conf = ap_get_module_config(cmd->server->module_config,
+                                                &csrf_protector_module);
+
+    const char *dir = ap_server_root_relative(cmd->pool, arg);
+    if (dir == NULL || !*arg)
+        return apr_pstrcat(cmd->pool, "storeDirectory: invalid path ", arg, NULL);
+    conf->storeDirectory = dir;
+
+    return NULL;
+}
+
+/*
+ * Function: csrfp_pragma_value
+ * Matches directive argument against allowed values of a pragma
+ *
+ * Parameters:
+ * p - pool
+ * arg - directive argument
+ * allowed - space separated allowed values, upper case
+ *
+ * Returns:
+ * allowed value matched, NULL if none
+ */
+static const char *csrfp_pragma_value(apr_pool_t *p, const char *arg,
+                                      const char *allowed)
+{
+    char *last;
+    char *value = apr_strtok(apr_pstrdup(p, allowed), " ", &last);
+    for (; value; value = apr_strtok(NULL, " ", &last)) {
+        if (!strcasecmp(value, arg)) {
+            return value;
         }
     }
+    return NULL;
+}
+
+/** storeJournalMode **/
+const char *csrfp_storeJournalMode_cmd(cmd_parms *cmd, void *cfg, const char *arg)
+{
+    csrfp_config *conf = ap_get_module_config(cmd->server->module_config,
+                                                &csrf_protector_module);
+
+    conf->storeJournalMode = csrfp_pragma_value(cmd->pool, arg, CSRFP_STORE_JOURNAL_MODES);
+    if (conf->storeJournalMode == NULL)
+        return "storeJournalMode must be one of " CSRFP_STORE_JOURNAL_MODES;
+
+    return NULL;
+}
+
+/** storeSynchronous **/
+const char *csrfp_storeSynchronous_cmd(cmd_parms *cmd, void *cfg, const char *arg)
+{
+    csrfp_config *conf = ap_get_module_config(cmd->server->module_config,
+                                                &csrf_protector_module);
+
+    conf->storeSynchronous = csrfp_pragma_value(cmd->pool, arg, CSRFP_STORE_SYNCHRONOUS);
+    if (conf->storeSynchronous == NULL)
+        return "storeSynchronous must be one of " CSRFP_STORE_SYNCHRONOUS;
+
+    return NULL;
+}
+
+/** storeBusyTimeout **/
+const char *csrfp_storeBusyTimeout_cmd(cmd_parms *cmd, void *cfg, const char *arg)
+{
+    csrfp_config *conf = ap_get_module_config(cmd->server->module_config,
+                                                &csrf_protector_module);
+
+    int timeout = atoi(arg);
+    if (timeout < 0 || (timeout == 0 && strcmp(arg, "0")))
+        return "storeBusyTimeout must be a non negative number of milliseconds";
+    conf->storeBusyTimeout = timeout;
+
+    return NULL;
+}
+
+/** storeMmapSize **/
+const char *csrfp_storeMmapSize_cmd(cmd_parms *cmd, void *cfg, const char *arg)
+{
+    csrfp_config *conf = ap_get_module_config(cmd->server->module_config,
+                                                &csrf_protector_module);
+
+    apr_int64_t size = apr_atoi64(arg);
+    if (size < 0 || (size == 0 && strcmp(arg, "0")))
+        return "storeMmapSize must be a non negative number of bytes";
+    conf->storeMmapSize = size;
+
+    return NULL;
+}
+
+/** storeCacheSize **/
+const char *csrfp_storeCacheSize_cmd(cmd_parms *cmd, void *cfg, const char *arg)
+{
+    csrfp_config *conf = ap_get_module_config(cmd->server->module_config,
+                                                &csrf_protector_module);
+
+    int size = atoi(arg);
+    if (size <= 0)
+        return "storeCacheSize must be a positive number of KiB";
+    conf->storeCacheSize = size;
+
+    return NULL;
+}
+
+/** attackLogRate **/
+const char *csrfp_attackLogRate_cmd(cmd_parms *cmd, void *cfg, const char *arg)
+{
+    csrfp_config *conf = ap_get_module_config(cmd->server->module_config,
+                                                &csrf_protector_module);
+
+    int rate = atoi(arg);
+    if (rate < 0 || (rate == 0 && strcmp(arg, "0")))
+        return "attackLogRate must be a non negative number";
+    conf->attackLogRate = rate;
+
+    return NULL;
+}
+
+/** throttleRate **/
+const char *csrfp_throttleRate_cmd(cmd_parms *cmd, void *cfg, const char *arg)
+{
+    csrfp_config *conf = ap_get_module_config(cmd->server->module_config,
+                                                &csrf_protector_module);
+
+    int rate = atoi(arg);
+    if (rate < 0 || (rate == 0 && strcmp(arg, "0")))
+        return "throttleRate must be a non negative number";
+    conf->throttleRate = rate;
+
+    return NULL;
+}
+
+/** throttleBurst **/
+const char *csrfp_throttleBurst_cmd(cmd_parms *cmd, void *cfg, const char *arg)
+{
+    csrfp_config *conf = ap_get_module_config(cmd->server->module_config,
+                                                &csrf_protector_module);
+
+    int burst = atoi(arg);
+    if (burst <= 0)
+        return "throttleBurst must be a positive number";
+    conf->throttleBurst = burst;
+
+    return NULL;
+}
+
+/** throttleAction **/
+const char *csrfp_throttleAction_cmd(cmd_parms *cmd, void *cfg, const char *arg)
+{
+    csrfp_config *conf = ap_get_module_config(cmd->server->module_config,
+                                                &csrf_protector_module);
+
+    if(!strcasecmp(arg, "429"))
+        conf->throttleAction = throttle_429;
+    else if (!strcasecmp(arg, "drop"))
+        conf->throttleAction = throttle_drop;
+    else
+        return "throttleAction must be one of 429, drop";
+
+    return NULL;
+}
+
+/** throttleKey **/
+const char *csrfp_throttleKey_cmd(cmd_parms *cmd, void *cfg, const char *arg)
+{
+    csrfp_config *conf = ap_get_module_config(cmd->server->module_config,
+                                                &csrf_protector_module);
+
+    if(!strcasecmp(arg, "ip"))
+        conf->throttleKey = throttle_key_ip;
+    else if (!strcasecmp(arg, "session"))
+        conf->throttleKey = throttle_key_session;
+    else
+        return "throttleKey must be one of ip, session";
 
     return NULL;
 }
@@ -1483,16 +5315,16 @@ static const command_rec csrfp_directives[] =
                 RSRC_CONF|ACCESS_CONF,
                 "csrfpEnable 'on'|'off', enables the module. Default is 'on'"),
     AP_INIT_TAKE1("csrfpAction", csrfp_action_cmd, NULL,
-                RSRC_CONF,
+                RSRC_CONF|ACCESS_CONF,
                 "Defines Action to be taken in case of failed validation"),
     AP_INIT_TAKE1("errorRedirectionUri", csrfp_errorRedirectionUri_cmd, NULL,
-                RSRC_CONF,
+                RSRC_CONF|ACCESS_CONF,
                 "Defines URL to redirect if action = redirect"),
     AP_INIT_TAKE1("errorCustomMessage", csrfp_errorCustomMessage_cmd, NULL,
-                RSRC_CONF,
+                RSRC_CONF|ACCESS_CONF,
                 "Defines Custom Error Message if action = message"),
     AP_INIT_TAKE1("jsFilePath", csrfp_jsFilePath_cmd, NULL,
-                RSRC_CONF,
+                RSRC_CONF|ACCESS_CONF,
                 "Absolute url of the js file"),
     AP_INIT_TAKE1("tokenLength", csrfp_tokenLength_cmd, NULL,
                 RSRC_CONF,
@@ -1501,11 +5333,92 @@ static const command_rec csrfp_directives[] =
                 RSRC_CONF,
                 "Name of the csrf token, 'default is csrfp_token'"),
     AP_INIT_TAKE1("disablesJsMessage", csrfp_disablesJsMessage_cmd, NULL,
-                RSRC_CONF,
+                RSRC_CONF|ACCESS_CONF,
                 "<noscript> message to be shown to user"),
     AP_INIT_ITERATE("verifyGetFor", csrfp_verifyGetFor_cmd, NULL,
                 RSRC_CONF|ACCESS_CONF,
                 "Pattern of urls for which GET request CSRF validation is enabled"),
+    AP_INIT_TAKE1("spoolSize", csrfp_spoolSize_cmd, NULL,
+                RSRC_CONF,
+                "Max bytes of html response buffered to send exact Content-Length, 0 for chunked"),
+    AP_INIT_TAKE1("injectionMarker", csrfp_injectionMarker_cmd, NULL,
+                RSRC_CONF,
+                "Marker emitted by application after which script is injected, instead of <body"),
+    AP_INIT_TAKE1("regenForBodiless", csrfp_regenForBodiless_cmd, NULL,
+                RSRC_CONF,
+                "regenForBodiless 'on'|'off', regenerate token for HEAD, 204, 206 & 304 responses. Default is 'off'"),
+    AP_INIT_TAKE1("validationPhase", csrfp_validationPhase_cmd, NULL,
+                RSRC_CONF,
+                "Request phase to validate in, post_read_request|header_parser|fixups. Default is fixups"),
+    AP_INIT_TAKE1("originCheck", csrfp_originCheck_cmd, NULL,
+                RSRC_CONF,
+                "Origin / Sec-Fetch-Site pre-check, off|reject|trust. Default is off"),
+    AP_INIT_ITERATE("trustedOrigin", csrfp_trustedOrigin_cmd, NULL,
+                RSRC_CONF,
+                "Origins (scheme://host[:port]) taken as this server's own by originCheck"),
+    AP_INIT_TAKE1("csrfpTokenMode", csrfp_tokenMode_cmd, NULL,
+                RSRC_CONF,
+                "Token verification, session|double-submit. Default is session"),
+    AP_INIT_TAKE1("negativeCacheSize", csrfp_negativeCacheSize_cmd, NULL,
+                RSRC_CONF,
+                "No of recently failed (sessid, token) pairs remembered per child, 0 to disable"),
+    AP_INIT_TAKE1("negativeCacheTTL", csrfp_negativeCacheTTL_cmd, NULL,
+                RSRC_CONF,
+                "Seconds a failed (sessid, token) pair is remembered"),
+    AP_INIT_TAKE1("tokenCacheSize", csrfp_tokenCacheSize_cmd, NULL,
+                RSRC_CONF,
+                "No of (sessid, token) pairs cached per child in front of the store, 0 to disable"),
+    AP_INIT_TAKE1("tokenRotateAge", csrfp_tokenRotateAge_cmd, NULL,
+                RSRC_CONF,
+                "Seconds a token is reused for before a new one is issued, 0 for no age limit"),
+    AP_INIT_TAKE1("tokenRotateUses", csrfp_tokenRotateUses_cmd, NULL,
+                RSRC_CONF,
+                "Validations a token is reused for before a new one is issued, 0 for no limit"),
+    AP_INIT_TAKE1("tokenWindow", csrfp_tokenWindow_cmd, NULL,
+                RSRC_CONF,
+                "No of last issued tokens of a session accepted, Default is 1"),
+    AP_INIT_TAKE1("storeBatchSize", csrfp_storeBatchSize_cmd, NULL,
+                RSRC_CONF,
+                "Token issuances committed together by each child, 0 to write inline"),
+    AP_INIT_TAKE1("storeBatchInterval", csrfp_storeBatchInterval_cmd, NULL,
+                RSRC_CONF,
+                "Max milliseconds a token issuance stays queued, Default is 20"),
+    AP_INIT_TAKE1("storeShards", csrfp_storeShards_cmd, NULL,
+                RSRC_CONF,
+                "No of db files token store is split into, Default is 1"),
+    AP_INIT_TAKE1("storeDirectory", csrfp_storeDirectory_cmd, NULL,
+                RSRC_CONF,
+                "Directory token store is kept in, Default is /tmp"),
+    AP_INIT_TAKE1("storeJournalMode", csrfp_storeJournalMode_cmd, NULL,
+                RSRC_CONF,
+                "journal_mode of token store, e.g. WAL, Default is left as is"),
+    AP_INIT_TAKE1("storeSynchronous", csrfp_storeSynchronous_cmd, NULL,
+                RSRC_CONF,
+                "synchronous level of token store - OFF, NORMAL or FULL"),
+    AP_INIT_TAKE1("storeBusyTimeout", csrfp_storeBusyTimeout_cmd, NULL,
+                RSRC_CONF,
+                "Milliseconds a request may wait on a locked token store, Default is 200"),
+    AP_INIT_TAKE1("storeMmapSize", csrfp_storeMmapSize_cmd, NULL,
+                RSRC_CONF,
+                "Bytes of token store accessed through mmap"),
+    AP_INIT_TAKE1("storeCacheSize", csrfp_storeCacheSize_cmd, NULL,
+                RSRC_CONF,
+                "KiB of page cache per token store connection"),
+    AP_INIT_TAKE1("attackLogRate", csrfp_attackLogRate_cmd, NULL,
+                RSRC_CONF,
+                "Attack log records per client per second, rest are aggregated, 0 for unlimited"),
+    AP_INIT_TAKE1("throttleRate", csrfp_throttleRate_cmd, NULL,
+                RSRC_CONF,
+                "Failed validations per minute allowed per client, 0 to disable throttling"),
+    AP_INIT_TAKE1("throttleBurst", csrfp_throttleBurst_cmd, NULL,
+                RSRC_CONF,
+                "Failed validations allowed per client in a burst"),
+    AP_INIT_TAKE1("throttleAction", csrfp_throttleAction_cmd, NULL,
+                RSRC_CONF,
+                "Action for throttled client, 429|drop. Default is 429"),
+    AP_INIT_TAKE1("throttleKey", csrfp_throttleKey_cmd, NULL,
+                RSRC_CONF,
+                "What identifies a client for throttling, ip|session. Default is ip"),
     { NULL }
 };
 
@@ -1515,14 +5428,26 @@ static const command_rec csrfp_directives[] =
  */
 static void csrfp_register_hooks(apr_pool_t *pool)
 {
+    // Handlers to set up shared & per child state
+#ifdef CSRFP_HTTPD_24
+    ap_hook_pre_config(csrfp_pre_config, NULL, NULL, APR_HOOK_MIDDLE);
+#endif
+    ap_hook_post_config(csrfp_post_config, NULL, NULL, APR_HOOK_MIDDLE);
+    ap_hook_child_init(csrfp_child_init, NULL, NULL, APR_HOOK_MIDDLE);
+
     // Handler to modify output filter
     ap_register_output_filter("csrfp_out_filter", csrfp_out_filter, NULL, AP_FTYPE_RESOURCE);
 
     // Create hooks in the request handler, so we get called when a request arrives
     ap_hook_insert_filter(csrfp_insert_filter, NULL, NULL, APR_HOOK_REALLY_FIRST);
 
-    // Handler to parse incoming request and validate incoming request
-    ap_hook_fixups(csrfp_header_parser, NULL, NULL, APR_HOOK_LAST);
+    // Handlers to parse incoming request and validate incoming request
+    // only the one matching validationPhase does the job, SetEnvIf
+    // shall have run before, so that csrfp_ignore_set can be honoured
+    static const char * const aszPre[] = { "mod_setenvif.c", NULL };
+    ap_hook_post_read_request(csrfp_post_read_request, aszPre, NULL, APR_HOOK_MIDDLE);
+    ap_hook_header_parser(csrfp_early_header_parser, aszPre, NULL, APR_HOOK_MIDDLE);
+    ap_hook_fixups(csrfp_fixups, NULL, NULL, APR_HOOK_LAST);
 }
 
 
@@ -1533,10 +5458,10 @@ static void csrfp_register_hooks(apr_pool_t *pool)
 module AP_MODULE_DECLARE_DATA csrf_protector_module =
 {
     STANDARD20_MODULE_STUFF,
-    NULL,
-    NULL,
+    csrfp_dir_config_create, /* Directory config create function */
+    csrfp_dir_config_merge, /* Directory config merge function */
     csrfp_srv_config_create, /* Server config create function */
-    NULL,
+    csrfp_srv_config_merge, /* Server config merge function */
     csrfp_directives,       /* Any directives we may have for httpd */
     csrfp_register_hooks    /* Our hook registering function */
 };
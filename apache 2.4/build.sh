@@ -0,0 +1,33 @@
+# MOD_CSRFPROTECTOR  - Apache 2.4.x module for mitigating CSRF vulnerabilities
+#                        In web applications
+#
+# Source is shared with the 2.2 build, version specific code is selected
+# at compile time from the module magic number of the httpd headers
+
+clear
+APACHE_VER=2.4
+SRC_DIR="../apache 2.2/src"
+echo "Building for apache version $APACHE_VER"
+echo "BUILD INIT...."
+echo "Initiating MOD_CSRFPROTECTOR BUILD PROCESS"
+sudo apxs -cia -n csrf_protector "$SRC_DIR/mod_csrfprotector.c" "$SRC_DIR/sqlite/sqlite3.c" -lssl -lcrypto
+echo "BUILD FINISHED ...!"
+
+echo "---------------------------------------------------"
+echo "Writing default configurations to /etc/apache2/mods-available/csrf_protector.conf"
+echo "#Configuration for CSRFProtector" > /etc/apache2/mods-available/csrf_protector.conf
+echo "<IfModule mod_csrfprotector.c>" >> /etc/apache2/mods-available/csrf_protector.conf
+echo "    csrfpEnable on" >> /etc/apache2/mods-available/csrf_protector.conf
+echo "    csrfpAction forbidden" >> /etc/apache2/mods-available/csrf_protector.conf
+echo "    errorCustomMessage \"<h2>Access forbidden by OWASP CSRFProtector</h2>\"" >> /etc/apache2/mods-available/csrf_protector.conf
+echo "    jsFilePath http://localhost/csrfp_js/csrfprotector.js" >> /etc/apache2/mods-available/csrf_protector.conf
+echo "    tokenLength 20" >> /etc/apache2/mods-available/csrf_protector.conf
+echo "</IfModule>" >> /etc/apache2/mods-available/csrf_protector.conf
+sudo a2enmod csrf_protector
+
+echo "Configuration write finished"
+echo "---------------------------------------------------"
+
+echo "Restarting APACHE ...!"
+sudo service apache2 restart
+echo "mod_csrfprotector has been compiled, installed and activated"